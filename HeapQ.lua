@@ -1,84 +1,190 @@
+local ffi = require 'ffi'
+
+local rshift = bit.rshift
+
+ffi.cdef [[
+
+struct heapq_entry
+{
+    float prio;
+    uint32_t payload;
+};
+
+]]
+
+local ctEntries = ffi.typeof 'struct heapq_entry[?]'
+local ctPositions = ffi.typeof 'int32_t[?]'
+
 local mHeapQ = {}
 local HeapQ = setmetatable({}, mHeapQ)
 local iHeapQ = {__index=HeapQ}
 
-local function fwd(a, b) return a < b end
-local function rev(a, b) return a > b end
-
-function mHeapQ:__call(cmp)
-  self = {}
-  if cmp == true then
-    self.cmp = rev
-  elseif not cmp then
-    self.cmp = fwd
-  else
-    self.cmp = cmp
+local EMPTY = {}
+local MIN_CAPACITY = 64
+
+-- A priority queue of uint32 payloads by float priority, smallest first.
+-- It is a 4-ary heap in one cdata array of struct heapq_entry: half the
+-- levels of a binary heap, with a node's children side by side.  A max
+-- heap stores negated priorities, so both share the same sifts.
+-- options: true, or a table of
+--   max: largest priority first
+--   capacity: entries to make room for up front (it grows as needed)
+--   maxPayload: keep each payload's position, for decreaseKey and
+--     contains; payloads must then be distinct and at most this
+-- Nothing is checked per operation; check() tests the heap as a whole.
+function mHeapQ:__call(options)
+  if options == true then options = {max=true} end
+  options = options or EMPTY
+  local capacity = math.max(options.capacity or 0, MIN_CAPACITY)
+  self = {
+    entries=ctEntries(capacity),
+    capacity=capacity,
+    n=0,
+    sign=options.max and -1 or 1,
+  }
+  if options.maxPayload then
+    self.positions = ctPositions(options.maxPayload + 1, -1)
   end
-  self.heap = {}
-  self.nodes = {}
-  self.n = 0
   return setmetatable(self, iHeapQ)
 end
 
-function HeapQ:add(k, v)
-  assert(type(k) == 'table')
-  assert(type(v) == 'number')
-  assert(v ~= nil, "cannot push nil")
-  local t = self.nodes
-  local h = self.heap
-  local cmp = self.cmp
-  local n = self.n + 1 -- node position in heap array (leaf)
-  local p = (n - n % 2) / 2 -- parent position in heap array
-  h[n] = k -- insert at a leaf
-  t[n] = v
-  self.n = n
-  while n > 1 and cmp(v, t[p]) do -- climb heap?
-    h[p], h[n] = h[n], h[p]
-    n = p
-    p = (n - n % 2) / 2
+-- Room for at least n entries
+local function reserve(self, n)
+  if n > self.capacity then
+    local capacity = math.max(n, 2 * self.capacity)
+    local entries = ctEntries(capacity)
+    ffi.copy(entries, self.entries, self.n * ffi.sizeof 'struct heapq_entry')
+    self.entries, self.capacity = entries, capacity
   end
 end
 
+-- Moves the hole at i up until (prio, payload) fits there, and puts it in
+local function siftUp(self, i, prio, payload)
+  local entries, positions = self.entries, self.positions
+  while i > 0 do
+    local p = rshift(i - 1, 2)
+    local pe = entries[p]
+    if pe.prio <= prio then break end
+    entries[i] = pe
+    if positions then positions[pe.payload] = i end
+    i = p
+  end
+  local e = entries[i]
+  e.prio, e.payload = prio, payload
+  if positions then positions[payload] = i end
+end
+
+-- Moves the hole at i down (among the first n entries) until (prio,
+-- payload) fits there, and puts it in
+local function siftDown(self, i, prio, payload, n)
+  local entries, positions = self.entries, self.positions
+  while true do
+    local c = 4 * i + 1
+    if c >= n then break end
+    local last = c + 3
+    if last >= n then last = n - 1 end
+    local best, bestPrio = c, entries[c].prio
+    for k = c + 1, last do
+      local kPrio = entries[k].prio
+      if kPrio < bestPrio then best, bestPrio = k, kPrio end
+    end
+    if bestPrio >= prio then break end
+    local be = entries[best]
+    entries[i] = be
+    if positions then positions[be.payload] = i end
+    i = best
+  end
+  local e = entries[i]
+  e.prio, e.payload = prio, payload
+  if positions then positions[payload] = i end
+end
+
+function HeapQ:add(payload, prio)
+  local n = self.n
+  if n == self.capacity then reserve(self, n + 1) end
+  self.n = n + 1
+  siftUp(self, n, self.sign * prio, payload)
+end
+
+-- The front payload and its priority, without removing them (nil if
+-- empty)
 function HeapQ:peek()
-  local t = self.nodes
-  local h = self.heap
-  local s = self.n
-  assert(s > 0, "cannot peek into empty heap")
-  local e = h[1] -- min (heap root)
-  local r = t[1]
-  return e, r
+  if self.n == 0 then return nil end
+  local e = self.entries[0]
+  return e.payload, self.sign * e.prio
 end
 
+-- Removes the front payload and returns it and its priority (nil if
+-- empty)
 function HeapQ:pop()
-  local t = self.nodes
-  local h = self.heap
-  local s = self.n
-  local cmp = self.cmp
-  assert(s > 0, "cannot pop from empty heap")
-  local e = h[1] -- min (heap root)
-  local r = t[1]
-  local v = t[s]
-  h[1] = h[s] -- move leaf to root
-  t[1] = t[s]
-  h[s] = nil -- remove leaf
-  t[s] = nil
-  s = s - 1
-  local n = 1 -- node position in heap array
-  local p = 2 * n -- left sibling position
-  if s > p and cmp(t[p+1], t[p]) then
-    p = 2 * n + 1 -- right sibling position
+  local n = self.n
+  if n == 0 then return nil end
+  local entries = self.entries
+  local payload, prio = entries[0].payload, entries[0].prio
+  n = n - 1
+  self.n = n
+  if n > 0 then
+    local e = entries[n]
+    siftDown(self, 0, e.prio, e.payload, n)
+  end
+  if self.positions then self.positions[payload] = -1 end
+  return payload, self.sign * prio
+end
+
+-- Moves payload, which must be queued, to prio, which must be no further
+-- from the front than its old one (lower in a min heap, higher in a max
+-- heap).  Needs options.maxPayload.
+function HeapQ:decreaseKey(payload, prio)
+  siftUp(self, self.positions[payload], self.sign * prio, payload)
+end
+
+-- Whether payload is queued.  Needs options.maxPayload.
+function HeapQ:contains(payload)
+  return self.positions[payload] >= 0
+end
+
+-- Replaces the contents with the n entries of src (a struct heapq_entry
+-- array) in O(n), by Floyd's method
+function HeapQ:heapify(src, n)
+  self:clear()
+  reserve(self, n)
+  local entries, positions, sign = self.entries, self.positions, self.sign
+  ffi.copy(entries, src, n * ffi.sizeof 'struct heapq_entry')
+  for i = 0, n - 1 do
+    local e = entries[i]
+    e.prio = sign * e.prio
+    if positions then positions[e.payload] = i end
+  end
+  self.n = n
+  for i = rshift(n + 2, 2) - 1, 0, -1 do
+    local e = entries[i]
+    siftDown(self, i, e.prio, e.payload, n)
+  end
+end
+
+function HeapQ:clear()
+  local positions = self.positions
+  if positions then
+    for i = 0, self.n - 1 do
+      positions[self.entries[i].payload] = -1
+    end
   end
-  while s >= p and cmp(t[p], v) do -- descend heap?
-    h[p], h[n] = h[n], h[p]
-    t[p], t[n] = t[n], t[p]
-    n = p
-    p = 2 * n
-    if s > p and cmp(t[p+1], t[p]) then
-      p = 2 * n + 1
+  self.n = 0
+end
+
+-- Whether the entries are in heap order (and, with options.maxPayload,
+-- the positions agree with them), for debugging
+function HeapQ:check()
+  local entries, positions = self.entries, self.positions
+  for i = 0, self.n - 1 do
+    if i > 0 and entries[rshift(i - 1, 2)].prio > entries[i].prio then
+      return false
+    end
+    if positions and positions[entries[i].payload] ~= i then
+      return false
     end
   end
-  self.n = s
-  return e, r
+  return true
 end
 
 function HeapQ:isEmpty()
@@ -93,4 +199,4 @@ function iHeapQ:__len()
   return self.n
 end
 
-return HeapQ
\ No newline at end of file
+return HeapQ
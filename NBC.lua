@@ -1,71 +1,209 @@
+local ffi = require 'ffi'
+local nbc = require 'nbc_cdef'
+local xmath = require 'xmath'
+
 local mNBC = {}
 local NBC = setmetatable({}, mNBC)
 local iNBC = {__index=NBC}
 
+ffi.cdef [[
+
+struct nbc_handle
+{
+    struct nbc *targets[1];
+};
+
+]]
+
+local ctHandle
+local iHandle = {}
+
+local log = math.log
+local softmax = xmath.softmax
+
+local EMPTY = {}
+
+local keyTags = {string=0, number=1}
+local numKey = ffi.new 'double[1]'
+local pNumKey = ffi.cast('const char *', numKey)
+
+local function wrap(handle)
+  local numClasses = handle.targets[0].numClasses
+  local self = {
+    handle=handle,
+    numClasses=numClasses,
+    featureIds={},      -- Cache of the model's index
+    scratchSize=0,
+    logPriors=ffi.new('double[?]', numClasses),
+    logWeights=ffi.new('double[?]', numClasses),
+  }
+  return setmetatable(self, iNBC)
+end
+
+-- A classifier of numClasses classes.  The counts and log-likelihoods
+-- live in a struct nbc; features (strings or numbers) are given dense IDs
+-- as they are first trained on.
 function mNBC:__call(numClasses)
-  self = {}
-  local classPops = {}
-  for i = 1, numClasses do
-    classPops[i] = 1
+  local handle = ctHandle()
+  handle.targets[0] = nbc.nbc_create(numClasses)
+  assert(handle.targets[0] ~= nil, "nbc_create failed")
+  return wrap(handle)
+end
+
+-- A classifier saved by save.  The file is mapped rather than read, so
+-- this takes the same time whatever the model's size, and processes
+-- loading the same file share its memory until they train on it.  Only
+-- the header is checked unless verify is true, which also checks the
+-- feature index (in time proportional to the file's size); use it for
+-- files that may have been damaged.
+function NBC.load(path, verify)
+  local handle = ctHandle()
+  handle.targets[0] = nbc.nbc_load(path, verify and 1 or 0)
+  assert(handle.targets[0] ~= nil, "nbc_load failed: " .. path)
+  return wrap(handle)
+end
+
+-- Writes the classifier to a file at path, for load
+function NBC:save(path)
+  local status = nbc.nbc_save(self.handle.targets[0], path)
+  assert(status == 0, "nbc_save failed: " .. path)
+end
+
+-- The ID of feature ft, or nil if it has not been trained on (unless add
+-- is true, in which case it is given the next ID)
+function NBC:featureId(ft, add)
+  local id = self.featureIds[ft]
+  if id then return id end
+  local tag = keyTags[type(ft)]
+  assert(tag, "NBC features must be strings or numbers")
+  local key, len = ft, 0
+  if tag == 0 then
+    len = #ft
+  else
+    numKey[0] = ft
+    key, len = pNumKey, 8
+  end
+  local model = self.handle.targets[0]
+  if add then
+    id = nbc.nbc_addFeature(model, tag, key, len)
+    assert(id >= 0, "nbc_addFeature failed")
+  else
+    id = nbc.nbc_findFeature(model, tag, key, len)
+    if id < 0 then return nil end
   end
-  self.classPops = classPops
-  self.featurePops = {}
-  self.featureStats = {}
-  self.numClasses = numClasses
-  self.totalPop = numClasses
-  setmetatable(self, iNBC)
-  return self
+  self.featureIds[ft] = id
+  return id
+end
+
+-- Samples seen of class cn (1-based), counting the 1 each starts with
+function NBC:classPop(cn)
+  return self.handle.targets[0].classPops[cn-1]
 end
-
-local emptyFW = {}
-function NBC:classify(features, fw, priors)
-  priors = priors or emptyFW
-  fw = fw or emptyFW
-  local weights = {}
-  for cn, cp in ipairs(self.classPops) do
-    table.insert(weights, math.log(priors[cn] or cp))
+
+-- Room for n feature IDs and weights in self.ids and self.weights
+local function reserve(self, n)
+  if n > self.scratchSize then
+    local size = math.max(n, 2 * self.scratchSize, 16)
+    self.ids = ffi.new('int32_t[?]', size)
+    self.weights = ffi.new('double[?]', size)
+    self.scratchSize = size
   end
+end
+
+-- Sums into out (a double[numClasses]) each class's log prior (from
+-- logPriors, a double[numClasses], or the class populations if nil) and
+-- the log-likelihoods of the n features ids (an int32_t array of IDs),
+-- each scaled by weights[k] (1 if weights is nil).  Returns out.
+function NBC:logWeights(ids, n, weights, logPriors, out)
+  nbc.nbc_logWeights(self.handle.targets[0], ids, weights, n,
+                     logPriors, out)
+  return out
+end
+
+-- self.logPriors filled in from priors (nil if priors is)
+local function toLogPriors(self, priors)
+  if not priors then return nil end
+  local logPriors = self.logPriors
+  for cn = 1, self.numClasses do
+    logPriors[cn-1] = log(priors[cn] or self:classPop(cn))
+  end
+  return logPriors
+end
+
+-- The posterior of each class given the list features, with each
+-- feature's log-likelihood scaled by fw[ft] (default 1) and priors[cn]
+-- (default the class's population) as class cn's prior.  Returns a list
+-- of probabilities, in dst if given.
+function NBC:classify(features, fw, priors, dst)
+  reserve(self, #features)
+  local ids, weights, n = self.ids, self.weights, 0
+  local featureIds = self.featureIds
   for _, ft in ipairs(features) do
-    local fsEntry = self.featureStats[ft]
-    if fsEntry then
-      local fp = self.featurePops[ft]
-      for i, cp in ipairs(self.classPops) do
-        local smooth = .5 * cp / self.numClasses
-        local with = fsEntry[i] + smooth
-        local without = fp - fsEntry[i] + smooth
-        local l = with / (with + without)
-        weights[i] = weights[i] + math.log(l) * (fw[ft] or 1)
-      end
+    local id = featureIds[ft] or self:featureId(ft)
+    if id then
+      ids[n] = id
+      weights[n] = fw and fw[ft] or 1
+      n = n + 1
     end
   end
-  local wSum = 0
-  for i, w in ipairs(weights) do
-    w = math.exp(w)
-    wSum = wSum + w
-    weights[i] = w
-  end
-  for i, w in ipairs(weights) do
-    weights[i] = w / wSum
+  local logPriors = toLogPriors(self, priors)
+  local lw = self:logWeights(ids, n, fw and weights or nil, logPriors,
+                             self.logWeights)
+  softmax(lw, self.numClasses)
+  dst = dst or {}
+  for i = 1, self.numClasses do
+    dst[i] = lw[i-1]
   end
-  return weights
+  return dst
 end
 
 function NBC:train1(features, class)
-  self.classPops[class] = self.classPops[class] + 1
-  self.totalPop = self.totalPop + 1
-  for _, ft in ipairs(features) do
-    local fsEntry = self.featureStats[ft]
-    if not fsEntry then
-      fsEntry = {}
-      self.featureStats[ft] = fsEntry
-      for i = 1, #self.classPops do
-        fsEntry[i] = 0
-      end
-    end
-    fsEntry[class] = fsEntry[class] + 1
-    local fp = self.featurePops[ft] or 0
-    self.featurePops[ft] = fp + 1
+  local model = self.handle.targets[0]
+  reserve(self, #features)
+  local ids, featureIds = self.ids, self.featureIds
+  for i, ft in ipairs(features) do
+    ids[i-1] = featureIds[ft] or self:featureId(ft, true)
   end
+  local status = nbc.nbc_train1(model, ids, #features, class - 1)
+  assert(status == 0, "nbc_train1 failed")
 end
 
+-- Trains on numSamples samples at once.  Sample s (from 0) has class
+-- classes[s] + 1 and the features whose IDs (from featureId) are
+-- ids[offsets[s]] .. ids[offsets[s+1]-1]; all three are int32_t arrays.
+-- options.threads (default 1) count in parallel.
+function NBC:trainBatch(offsets, ids, classes, numSamples, options)
+  options = options or EMPTY
+  local status = nbc.nbc_trainBatch(self.handle.targets[0], offsets, ids,
+                                    classes, numSamples,
+                                    options.threads or 1)
+  assert(status == 0, "nbc_trainBatch failed")
+end
+
+-- The posteriors of numSamples samples, given as for trainBatch, as a
+-- double[numSamples * numClasses] (options.out, if given) in which
+-- sample s's posterior for class cn is at s * numClasses + cn - 1.
+-- options.weights: a double per feature ID in ids, to scale its
+--   log-likelihood by
+-- options.priors: a list of class priors (default the class populations)
+-- options.threads: classify on that many threads (default 1)
+function NBC:classifyBatch(offsets, ids, numSamples, options)
+  options = options or EMPTY
+  local numClasses = self.numClasses
+  local out = options.out or ffi.new('double[?]', numSamples * numClasses)
+  local logPriors = toLogPriors(self, options.priors)
+  local status = nbc.nbc_classifyBatch(self.handle.targets[0], offsets,
+                                       ids, options.weights, numSamples,
+                                       logPriors, options.threads or 1,
+                                       out)
+  assert(status == 0, "nbc_classifyBatch failed")
+  return out
+end
+
+function iHandle:__gc()
+  nbc.nbc_free(self.targets[0])
+end
+
+ctHandle = ffi.metatype('struct nbc_handle', iHandle)
+
 return NBC
\ No newline at end of file
@@ -1,5 +1,7 @@
 local ffi = require 'ffi'
 local libyflood = require 'libyflood'
+local Pix = require 'lept.Pix'
+require 'ocr_cdef'
 local sqlsearcher = require 'sqlsearcher'
 
 local mOcr = {}
@@ -13,11 +15,21 @@ struct ocr_holder
     HOCR handles[1];
 };
 
+struct ocr_pool_holder
+{
+    HOCRPOOL handles[1];
+};
+
 ]]
-local ctOcr
+local ctOcr, ctOcrPool
+
+local OcrPool = {}
+local iOcrPool = {__index=OcrPool}
 
 local getfile = sqlsearcher.getfile
 
+local GUESS_CAPACITY = 3
+
 function mOcr:__call()
   local holder = ffi.new(ctOcr)
   local allocResult = libyflood.yf_ocr_new(nil, holder.handles)
@@ -29,15 +41,10 @@ function mOcr:__call()
   end
 end
 
-function Ocr:read(bitmap)
-  local guesses = ffi.new('struct char_guess[3]')
+-- Guesses first .. first+capacity-1 as a table of character -> prob
+local function toGuessTab(guesses, first, capacity)
   local guessTab = {}
-  libyflood.yf_ocr_read(self.handles[0],
-                        bitmap.topLeft,
-                        bitmap.width, bitmap.height,
-                        bitmap.xStride, bitmap.yStride,
-                        guesses, 3)
-  for i = 0, 2 do
+  for i = first, first + capacity - 1 do
     if guesses[i].codePoint == 0 or guesses[i].prob ~= guesses[i].prob then
       break
     else
@@ -48,10 +55,134 @@ function Ocr:read(bitmap)
   return guessTab
 end
 
+-- Up to maxGuesses (default 3) alternatives for the character in bitmap,
+-- as a table of character -> confidence (0 to 1)
+function Ocr:read(bitmap, maxGuesses)
+  maxGuesses = maxGuesses or GUESS_CAPACITY
+  local guesses = ffi.new('struct char_guess[?]', maxGuesses)
+  local status = libyflood.yf_ocr_read(self.handles[0],
+                                       bitmap.topLeft,
+                                       bitmap.width, bitmap.height,
+                                       bitmap.xStride, bitmap.yStride,
+                                       guesses, maxGuesses)
+  assert(status == 0, "yf_ocr_read failed")
+  return toGuessTab(guesses, 0, maxGuesses)
+end
+
+-- A BOX for box, a {x=, y=, width=, height=} rectangle (or a BOX already)
+local function toBox(box)
+  if type(box) == 'table' then
+    return ffi.new('BOX', box.x, box.y, box.width, box.height, 1)
+  else
+    return box
+  end
+end
+
+-- Up to maxGuesses alternatives, as read gives, for the character in box
+-- (default all) of pix, which may be a 1-bpp mask.  Tesseract reads pix in
+-- place, without a copy.
+function Ocr:readPix(pix, box, maxGuesses)
+  maxGuesses = maxGuesses or GUESS_CAPACITY
+  local guesses = ffi.new('struct char_guess[?]', maxGuesses)
+  local status = libyflood.yf_ocr_read_pix(self.handles[0], Pix.toPPix(pix),
+                                           toBox(box), guesses, maxGuesses)
+  assert(status == 0, "yf_ocr_read_pix failed")
+  return toGuessTab(guesses, 0, maxGuesses)
+end
+
+-- Reads the character that segment seg of watershed (a Watershed) makes,
+-- through its mask and bbox
+function Ocr:readSegment(watershed, seg, maxGuesses)
+  local mask, root = watershed:segmentMask(seg)
+  local box = {x=root.minX, y=root.minY,
+               width=root.maxX - root.minX + 1,
+               height=root.maxY - root.minY + 1}
+  return self:readPix(mask, box, maxGuesses)
+end
+
+-- Calls read(glyphs, numGlyphs, guesses, capacity), one of the batch
+-- functions with its handle and image bound, for the readBatch methods
+local function readBatch(read, glyphs, numGlyphs)
+  if type(glyphs) == 'table' then
+    numGlyphs = #glyphs
+    local rects = ffi.new('struct ocr_glyph[?]', numGlyphs)
+    for i, g in ipairs(glyphs) do
+      local r = rects[i-1]
+      r.x, r.y, r.width, r.height = g.x, g.y, g.width, g.height
+    end
+    glyphs = rects
+  end
+  local guesses = ffi.new('struct char_guess[?]', numGlyphs * GUESS_CAPACITY)
+  local status = read(glyphs, numGlyphs, guesses, GUESS_CAPACITY)
+  assert(status == 0, "OCR batch failed")
+  local result = {}
+  for i = 0, numGlyphs - 1 do
+    result[i+1] = toGuessTab(guesses, i * GUESS_CAPACITY, GUESS_CAPACITY)
+  end
+  return result
+end
+
+-- Reads many glyphs of one bitmap in a single call.  glyphs is a list of
+-- {x=, y=, width=, height=} rectangles within the bitmap, or a
+-- struct ocr_glyph array of numGlyphs.  Returns a list of guess tables,
+-- as read gives, in the same order.
+function Ocr:readBatch(bitmap, glyphs, numGlyphs)
+  assert(bitmap.xStride == 1, "readBatch needs an xStride of 1")
+  local handle = self.handles[0]
+  return readBatch(function(...)
+    return libyflood.yf_ocr_read_batch(handle, bitmap.topLeft,
+                                       bitmap.width, bitmap.height,
+                                       bitmap.yStride, ...)
+  end, glyphs, numGlyphs)
+end
+
+-- As readBatch, for glyphs within pix (which may be a 1-bpp mask)
+function Ocr:readPixBatch(pix, glyphs, numGlyphs)
+  local handle, ppix = self.handles[0], Pix.toPPix(pix)
+  return readBatch(function(...)
+    return libyflood.yf_ocr_read_pix_batch(handle, ppix, ...)
+  end, glyphs, numGlyphs)
+end
+
+-- A pool of numEngines OCR engines, whose readBatch (as Ocr:readBatch)
+-- reads on that many threads and returns when the batch is done
+function Ocr.newPool(numEngines)
+  local holder = ffi.new(ctOcrPool)
+  local allocResult = libyflood.yf_ocr_pool_new(nil, numEngines,
+                                                holder.handles)
+  if allocResult ~= 0 then
+    error('OCR pool init failed: code ' .. math.abs(allocResult))
+  end
+  return holder
+end
+
+function OcrPool:readBatch(bitmap, glyphs, numGlyphs)
+  assert(bitmap.xStride == 1, "readBatch needs an xStride of 1")
+  local handle = self.handles[0]
+  return readBatch(function(...)
+    return libyflood.yf_ocr_pool_read_batch(handle, bitmap.topLeft,
+                                            bitmap.width, bitmap.height,
+                                            bitmap.yStride, ...)
+  end, glyphs, numGlyphs)
+end
+
+function OcrPool:readPixBatch(pix, glyphs, numGlyphs)
+  local handle, ppix = self.handles[0], Pix.toPPix(pix)
+  return readBatch(function(...)
+    return libyflood.yf_ocr_pool_read_pix_batch(handle, ppix, ...)
+  end, glyphs, numGlyphs)
+end
+
 function iOcr:__gc()
   libyflood.yf_ocr_free(self.handles[0])
 end
 
 ctOcr = ffi.metatype('struct ocr_holder', iOcr)
 
+function iOcrPool:__gc()
+  libyflood.yf_ocr_pool_free(self.handles[0])
+end
+
+ctOcrPool = ffi.metatype('struct ocr_pool_holder', iOcrPool)
+
 return Ocr
@@ -1,28 +1,22 @@
 local ffi = require 'ffi'
-
-local rawset, type = rawset, type
-local copy = ffi.copy
-local ffi_string = ffi.string
+require 'pixelsort_cdef'
 
 local max, min = math.max, math.min
 
 local mSegment = {}
 local Segment = setmetatable({}, mSegment)
-local iSegment = {__index=Segment}
-
-ffi.cdef [[
-  struct segName
-  {
-    double mass;
-    double minX, maxX, minY, maxY;
-    double xSum, ySum;
-    bool border;
-  };
-]]
+local iSegment = {}
 
-local ctSegName = ffi.typeof 'struct segName'
-local szSegName = ffi.sizeof(ctSegName)
-local lIn, rIn, out = ctSegName(), ctSegName(), ctSegName()
+-- A segment is a struct wsGridCell: either a watershed root, viewed in
+-- place through the const pointer Segment.view makes of it, or a
+-- free-standing record made by Segment(x, y), '+' and the with* copies.
+-- Both are read-only, so that nothing but the watershed changes a live
+-- record.  Statistics are read straight from the record, so no field
+-- access allocates.
+local ctSegment = ffi.typeof 'const struct wsGridCell'
+local ctPSegment = ffi.typeof 'struct wsGridCell *'
+local ctCPSegment = ffi.typeof 'const struct wsGridCell *'
+local scratch = ffi.new 'struct wsGridCell'
 
 local snFields = {
   mass=true,
@@ -31,65 +25,58 @@ local snFields = {
   border=true,
 }
 
-local function doAdd(l, r)
-  copy(lIn, l, szSegName)
-  copy(rIn, r, szSegName)
-  out.mass = lIn.mass + rIn.mass
-  out.minX = min(lIn.minX, rIn.minX)
-  out.maxX = max(lIn.maxX, rIn.maxX)
-  out.minY = min(lIn.minY, rIn.minY)
-  out.maxY = max(lIn.maxY, rIn.maxY)
-  out.xSum = lIn.xSum + rIn.xSum
-  out.ySum = lIn.ySum + rIn.ySum
-  out.border = lIn.border or rIn.border
-  return ffi_string(out, szSegName)
+-- Fills scratch from seg.  Free-standing records belong to no watershed,
+-- so they have no parent.
+local function load(seg)
+  ffi.copy(scratch, seg, ffi.sizeof(scratch))
+  scratch.parent = nil
 end
 
-local function wrap(n)
-  local result = {name=n}
-  setmetatable(result, iSegment)
-  return result
+-- A read-only view of a record the watershed hands out
+function Segment.view(p)
+  return ffi.cast(ctCPSegment, p)
+end
+
+-- A segment as the struct wsGridCell * that the C functions take
+function Segment.record(seg)
+  return ffi.cast(ctPSegment, seg)
 end
 
 function mSegment:__call(x, y)
-  out.mass = 1
-  out.minX = x
-  out.maxX = x
-  out.minY = y
-  out.maxY = y
-  out.xSum = x
-  out.ySum = y
-  return wrap(ffi_string(out, szSegName))
+  ffi.fill(scratch, ffi.sizeof(scratch))
+  scratch.visited = 1
+  scratch.mass = 1
+  scratch.minX, scratch.maxX = x, x
+  scratch.minY, scratch.maxY = y, y
+  scratch.xSum, scratch.ySum = x, y
+  return ctSegment(scratch)
 end
 
 function iSegment.__add(l, r)
-  if type(l) ~= 'string' then l = l.name end
-  if type(r) ~= 'string' then r = r.name end
-  return wrap(doAdd(l, r))
+  load(l)
+  scratch.mass = l.mass + r.mass
+  scratch.minX = min(l.minX, r.minX)
+  scratch.maxX = max(l.maxX, r.maxX)
+  scratch.minY = min(l.minY, r.minY)
+  scratch.maxY = max(l.maxY, r.maxY)
+  scratch.xSum = l.xSum + r.xSum
+  scratch.ySum = l.ySum + r.ySum
+  scratch.atBorder = (l.atBorder ~= 0 or r.atBorder ~= 0) and 1 or 0
+  scratch.peak = max(l.peak, r.peak)
+  return ctSegment(scratch)
 end
 
 function iSegment:__index(k)
   if k == 'cx' then
-    local result = self.xSum / self.mass
-    rawset(self, k, result)
-    return result
+    return self.xSum / self.mass
   elseif k == 'cy' then
-    local result = self.ySum / self.mass
-    rawset(self, k, result)
-    return result
+    return self.ySum / self.mass
   elseif k == 'width' then
-    local result = self.maxX - self.minX + 1
-    rawset(self, k, result)
-    return result
+    return self.maxX - self.minX + 1
   elseif k == 'height' then
-    local result = self.maxY - self.minY + 1
-    rawset(self, k, result)
-    return result
-  elseif snFields[k] then
-    copy(lIn, self.name, szSegName)
-    local result = lIn[k]
-    rawset(self, k, result)
-    return result
+    return self.maxY - self.minY + 1
+  elseif k == 'border' then
+    return self.atBorder ~= 0
   else
     return Segment[k]
   end
@@ -100,18 +87,23 @@ function iSegment:__newindex(k)
 end
 
 function iSegment:__tostring()
-  copy(lIn, self.name, szSegName)
-  return string.format("[segment: l=%d t=%d r=%d b=%d mass=%d]", lIn.minX, lIn.minY, lIn.maxX, lIn.maxY, lIn.mass)
+  return string.format("[segment: l=%d t=%d r=%d b=%d mass=%d]", self.minX, self.minY, self.maxX, self.maxY, self.mass)
 end
 
 for fName, _ in pairs(snFields) do
   local mutatorName =
     'with' .. fName:sub(1,1):upper() .. fName:sub(2)
   Segment[mutatorName] = function(self, newVal)
-    copy(out, self.name, szSegName)
-    out[fName] = newVal
-    return wrap(ffi_string(out, szSegName))
+    load(self)
+    if fName == 'border' then
+      scratch.atBorder = newVal and newVal ~= 0 and 1 or 0
+    else
+      scratch[fName] = newVal
+    end
+    return ctSegment(scratch)
   end
 end
 
+ffi.metatype('struct wsGridCell', iSegment)
+
 return Segment
@@ -1,10 +1,10 @@
 local Pix = require 'lept.Pix'
 local ffi = require 'ffi'
 local liblept = require 'liblept'
-local point16 = require 'point16'
+local Segment = require 'Segment'
 
-local bor = bit.bor
 local max = math.max
+local view, record = Segment.view, Segment.record
 
 local mWatershed = {}
 local Watershed = setmetatable({}, mWatershed)
@@ -25,26 +25,110 @@ struct wshed_handle
 local ctHandle
 local iHandle = {}
 
-local GridCell = {}
-local ctGridCell
-local iGridCell = {}
-
 local EMPTY = {}
-local NaN = math.huge - math.huge
 
-function mWatershed:__call(fpix)
+local ctOptions = ffi.typeof 'struct wshedOptions'
+local queueModes = {
+  sorted=C.WQ_SORTED,
+  buckets=C.WQ_BUCKETS,
+}
+
+local connectivities = {
+  [8]=C.WC_8,
+  [4]=C.WC_4,
+  [6]=C.WC_HEX, hex=C.WC_HEX,
+}
+
+local function toCOptions(options)
+  local cOptions = ctOptions()
+  cOptions.queueMode = assert(queueModes[options.queue or 'sorted'],
+                              "invalid queue mode")
+  cOptions.levels = options.levels or 0
+  cOptions.threads = options.threads or 1
+  cOptions.overlap = options.overlap or 0
+  cOptions.arena = options.arena
+  cOptions.mergeTree = options.mergeTree and 1 or 0
+  cOptions.connectivity = assert(connectivities[options.connectivity or 8],
+                                 "invalid connectivity")
+  return cOptions
+end
+
+-- options.queue: 'sorted' (default) floods in exact intensity order;
+--   'buckets' floods by intensity quantized to options.levels steps
+-- options.threads: flood that many horizontal bands in parallel, each
+--   options.overlap rows taller on either side, then stitch the seams.
+--   Only the C mergeStrategy is used (shouldMerge is not called); with
+--   none, conflicts are merged.
+-- options.arena: from Watershed.newArena, to take the per-frame buffers
+--   from instead of the heap
+-- options.mergeTree: log every merge, so that cut() can relabel for other
+--   merge rules without flooding again
+-- options.connectivity: 8 (default) or 4 neighbours, or 6 (or 'hex') for a
+--   hexagonal grid with odd rows offset half a pixel right
+function mWatershed:__call(fpix, options)
+  options = options or EMPTY
   local handle = ctHandle()
-  self = { handle=handle, fpix=fpix }
-  handle.targets[0] = pixelsort.wshed_create(fpix:toPFPix())
+  self = { handle=handle, fpix=fpix, arena=options.arena }
+  handle.targets[0] = pixelsort.wshed_create(fpix:toPFPix(),
+                                             toCOptions(options))
+  assert(handle.targets[0] ~= nil, "wshed_create failed")
   setmetatable(self, iWatershed)
   return self
 end
 
+local ctArena = ffi.typeof 'struct wshedArena'
+local arenaBuffers = setmetatable({}, {__mode='k'})
+
+-- An arena big enough for a Watershed with these options on width x height
+-- frames.  It must not be shared by watersheds that are alive at once.
+function Watershed.newArena(width, height, options)
+  local size = pixelsort.wshed_arenaSize(width, height,
+                                         toCOptions(options or EMPTY))
+  local buffer = ffi.new('uint8_t[?]', size)
+  local arena = ctArena(buffer, size, 0)
+  arenaBuffers[arena] = buffer
+  return arena
+end
+
+-- The flood state as a string, to be resumed by Watershed.restore.  A
+-- merge pending when it was taken is asked about again on resuming.
+function Watershed:snapshot()
+  local cws = self.handle.targets[0]
+  local size = pixelsort.wshed_snapshot(cws, nil, 0)
+  local buffer = ffi.new('uint8_t[?]', size)
+  assert(pixelsort.wshed_snapshot(cws, buffer, size) == size)
+  return ffi.string(buffer, size)
+end
+
+-- Resumes a snapshot of a flood over fpix.  A built-in merge rule comes
+-- back with it; setMergeRule's otherwise function does not.
+function Watershed.restore(fpix, snapshot)
+  local handle = ctHandle()
+  local self = { handle=handle, fpix=fpix }
+  handle.targets[0] = pixelsort.wshed_restore(snapshot, #snapshot,
+                                              fpix:toPFPix())
+  assert(handle.targets[0] ~= nil, "wshed_restore failed")
+  return setmetatable(self, iWatershed)
+end
+
+-- Floods a new frame, reusing this watershed's buffers (and merge rule)
+function Watershed:reset(fpix)
+  local status = pixelsort.wshed_reset(self.handle.targets[0],
+                                       fpix:toPFPix())
+  assert(status == 0, "wshed_reset failed")
+  self.fpix = fpix
+  self.borderP = nil
+  self.segMask = nil
+end
+
 do
   local pixSeg = ffi.new 'struct wsGridCell *[1]'
   local mergePair = ffi.new 'struct wsGridCell *[2]'
   local mrBuf = ffi.new 'enum mergeResult[1]'
+  -- shouldMerge(pixSeg, seg1, seg2) is called for each conflict that the
+  -- merge rule (see setMergeRule) leaves undecided
   function Watershed:fill(shouldMerge)
+    shouldMerge = shouldMerge or self.otherwise
     local mr = nil
     while true do
       local fpr =
@@ -53,7 +137,9 @@ do
       if fpr == C.FPR_DONE then
         return nil, 'C.FPR_DONE', self.handle.targets[0].nextRank
       elseif fpr == C.FPR_NEEDSMERGE then
-        mrBuf[0] = shouldMerge(pixSeg[0], mergePair[0], mergePair[1])
+        assert(shouldMerge, "no merge rule or shouldMerge function")
+        mrBuf[0] = shouldMerge(view(pixSeg[0]), view(mergePair[0]),
+                               view(mergePair[1]))
         mr = mrBuf
         assert(mr[0] ~= C.MR_YIELD)
       end
@@ -61,8 +147,83 @@ do
   end
 end
 
-function Watershed.confirmMerge(seg1, seg2)
-  pixelsort.wshed_merge(seg1, seg2)
+local mergeRules = {
+  caller=C.WM_CALLER,
+  always=C.WM_ALWAYS,
+  edge=C.WM_EDGE,
+  mass=C.WM_MASS,
+  bbox=C.WM_BBOX,
+  depth=C.WM_DEPTH,
+}
+
+local params = ffi.new 'struct wshedMergeParams'
+local function toMergeParams(rule)
+  params.rule = assert(mergeRules[rule.rule or 'caller'],
+                       "invalid merge rule")
+  params.otherwise = rule.otherwise and C.MR_YIELD or C.MR_EDGE
+  params.minMass = rule.minMass or 0
+  params.maxWidth = rule.maxWidth or 0
+  params.maxHeight = rule.maxHeight or 0
+  params.minDepth = rule.minDepth or 0
+  return params
+end
+
+-- Selects a built-in merge rule, so that fill() runs without calling back
+-- into Lua, e.g. {rule='mass', minMass=30}.  Conflicts the rule doesn't
+-- merge become edges, or are passed to rule.otherwise if that is given.
+function Watershed:setMergeRule(rule)
+  pixelsort.wshed_setMergeRule(self.handle.targets[0], toMergeParams(rule))
+  self.otherwise = rule.otherwise
+end
+
+-- Labels (as labels() does) for a flood made with options.mergeTree, as
+-- if only the merges that a built-in rule allows had been made, e.g.
+-- {rule='depth', minDepth=10}
+function Watershed:cut(rule)
+  local cws = self.handle.targets[0]
+  local labels = Pix.create(cws.width, cws.height, 32)
+  local n = pixelsort.wshed_cutLabels(cws, toMergeParams(rule),
+                                      Pix.toPPix(labels))
+  assert(n >= 0, "wshed_cutLabels failed")
+  return labels, n
+end
+
+-- Floods a width x height image too big to hold at once, a band of
+-- options.bandRows rows at a time.  source is an 8- or 16-bpp Pix, or
+-- function(y, row) that fills row[0] .. row[width-1] with row y (rows are
+-- asked for once each, in order).  onSegment(seg) gets each segment as
+-- soon as it is finished; seg is only valid during the call.
+-- options.rule is a built-in merge rule as for setMergeRule (default:
+-- merge every conflict); the other options are as for Watershed().
+-- Returns the number of segments.
+function Watershed.stream(width, height, source, onSegment, options)
+  options = options or EMPTY
+  local reader, readerCtx, sink
+  if type(source) == 'function' then
+    reader = ffi.cast('wshedRowReader', function(_, y, row)
+      source(y, row)
+      return 0
+    end)
+  else
+    local w, h = source:getDimensions()
+    assert(w == width and h == height, "wrong size of Pix")
+    reader, readerCtx = C.wshed_pixRowReader, Pix.toPPix(source)
+  end
+  if onSegment then
+    sink = ffi.cast('wshedSegmentSink', function(_, seg) onSegment(seg) end)
+  end
+  local n = pixelsort.wshed_stream(width, height, options.bandRows or 0,
+                                   toCOptions(options),
+                                   options.rule and toMergeParams(options.rule),
+                                   reader, readerCtx, sink, nil)
+  if type(source) == 'function' then reader:free() end
+  if sink then sink:free() end
+  assert(n >= 0, "wshed_stream failed")
+  return n
+end
+
+function Watershed.confirmMerge(pixSeg, seg1, seg2)
+  pixelsort.wshed_merge(record(seg1), record(seg2))
   return C.MR_RETRY
 end
 
@@ -70,17 +231,14 @@ end
 -- perimeter of the image until we find a segment of large enough mass.)
 function Watershed:findBorder()
   if not self.borderP then
-    local fpix = self.fpix
+    local cws = self.handle.targets[0]
     local borderP, borderMass = nil, 5000
-    for _, bx in ipairs {0, math.floor(fpix.width * .5), fpix.width - 1} do
-      for _, by in ipairs {0, math.floor(fpix.height * .5), fpix.height - 1} do
-        local p = self.pgrid[by][bx]
-        if type(p) == 'table' then
-          p = p:find()
-          if p.val.mass > borderMass then
-            borderP = p
-            borderMass = p.val.mass
-          end
+    for _, bx in ipairs {0, math.floor(cws.width * .5), cws.width - 1} do
+      for _, by in ipairs {0, math.floor(cws.height * .5), cws.height - 1} do
+        local p = view(pixelsort.wshed_segmentAt(cws, bx, by))
+        if p ~= nil and p.mass > borderMass then
+          borderP = p
+          borderMass = p.mass
         end
       end
     end
@@ -90,119 +248,83 @@ function Watershed:findBorder()
 end
 
 function Watershed:highlight(seg)
-  seg = pixelsort.wshed_find(seg)
   local cws = self.handle.targets[0]
   local mask = Pix.create(cws.width, cws.height, 1)
-  for y = seg.minY, seg.maxY do
-    local pgrow = self.handle.targets[0].pgrid + y * cws.width
-    for x = seg.minX, seg.maxX do
-      if pixelsort.wshed_find(pgrow[x]) == seg then
-        mask:setPixel(x, y, 1)
-      end
-    end
-  end
+  local status = pixelsort.wshed_maskSegment(cws, record(seg),
+                                             Pix.toPPix(mask))
+  assert(status == 0, "wshed_maskSegment failed")
   return mask
 end
 
+-- A 1-bpp mask of seg's segment and seg's root, whose minX..maxY bbox
+-- the mask is set within (e.g. for Ocr:readPix).  The mask is reused by
+-- the next call, which only clears and sets the bits within its own bbox.
+function Watershed:segmentMask(seg)
+  local cws = self.handle.targets[0]
+  local mask = self.segMask
+  if not mask then
+    mask = Pix.create(cws.width, cws.height, 1)
+    self.segMask = mask
+  end
+  local status = pixelsort.wshed_maskSegment(cws, record(seg),
+                                             Pix.toPPix(mask))
+  assert(status == 0, "wshed_maskSegment failed")
+  return mask, view(pixelsort.wshed_find(record(seg)))
+end
+
 function Watershed:highlightUnvisited()
   local cws = self.handle.targets[0]
   local mask = Pix.create(cws.width, cws.height, 1)
-  for y = 0, cws.height-1 do
-    local pgrow = self.handle.targets[0].pgrid + y * cws.width
-    for x = 0, cws.width-1 do
-      if pgrow[x].visited <= 0 then
-        mask:setPixel(x, y, 1)
-      end
-    end
-  end
+  local status = pixelsort.wshed_maskUnvisited(cws, Pix.toPPix(mask))
+  assert(status == 0, "wshed_maskUnvisited failed")
   return mask
 end
 
+-- 32-bpp Pix of each pixel's root record index + 1 (0 for edge/unvisited)
+function Watershed:rootLabels()
+  local cws = self.handle.targets[0]
+  local labels = Pix.create(cws.width, cws.height, 32)
+  local status = pixelsort.wshed_labelRoots(cws, Pix.toPPix(labels))
+  assert(status == 0, "wshed_labelRoots failed")
+  return labels
+end
+
+-- Dense segment IDs 0..n-1 (pixelsort.WS_NO_LABEL where there is no
+-- segment) as a 32-bpp Pix, plus n
+function Watershed:labels()
+  local cws = self.handle.targets[0]
+  local labels = Pix.create(cws.width, cws.height, 32)
+  local n = pixelsort.wshed_labels(cws, Pix.toPPix(labels))
+  assert(n >= 0, "wshed_labels failed")
+  return labels, n
+end
+
 function Watershed:segmentContains(p, x, y)
-  local i = y * self.fpix.w + x
-  return pixelsort.wshed_find(self.handle.targets[0].pgrid[i]) ==
-         pixelsort.wshed_find(p)
+  return pixelsort.wshed_segmentAt(self.handle.targets[0], x, y) ==
+         pixelsort.wshed_find(record(p))
 end
 
+-- Raise the intensity of pending pixels next to segments of fewer than
+-- thres (default 7) pixels by val (default 2), so that they are flooded
+-- sooner.  Needs the sorted queue and one thread.  Returns how many.
 function Watershed:setSmallSegPriority(thres, val)
-  thres = thres or 7
-  val = val or 2.
-  local buffer = self.buffer
-  for j = 0, self.numPixels-1 do
-    local x, y = buffer[j].x, buffer[j].y
-    local pgrow = self.pgrid[y]
-    local pebble = false
-    for dy = -1,1 do
-      local ny = y + dy
-      local pgrow = self.pgrid[ny]
-      if pgrow then
-        for dx = -1,1 do
-          if bor(dx, dy) ~= 0 then
-            local nx = x + dx
-            local np = pgrow[nx]
-            if np and np ~= true then
-              np = np:find()
-              if np.val.mass < thres then
-                pebble = true
-                break
-              end
-            end
-          end
-        end
-      end
-      if pebble then break end
-    end
-    if pebble then
-      buffer[j].intensity = buffer[j].intensity + val
-    end
-  end
+  local n = pixelsort.wshed_setSmallSegPriority(self.handle.targets[0],
+                                                thres or 7, val or 2)
+  assert(n >= 0, "wshed_setSmallSegPriority failed (it needs a sorted, " ..
+                 "single-threaded flood)")
+  return n
 end
 
--- Clear stray edge pixels and dead segments
--- May need to be translated to C
---[[
+-- Clear stray edge pixels and dead segments: an edge pixel joins the
+-- segments around it if at most one has options.critMass (default 20)
+-- pixels or more.  Returns the number of pixels absorbed.
 function Watershed:prune(options)
   options = options or EMPTY
-  local fillModes =
-    setmetatable({
-      noMerge=true, mayPruneCordon=true, keepDark=false
-    }, {__index=options})
-  local critMass = options.critMass or 20
-  local buffer = self.buffer
-  repeat
-    local anyExtended = false
-    local k = 0
-    for j = 0, self.numPixels-1 do
-      local x, y = buffer[j].x, buffer[j].y
-      local pgrow = self.pgrid[y]
-      local p = pgrow[x]
-      local isEdge = true
-      if p == true then
-        local fillResult = fillPixel(self, NaN, x, y, NaN, fillModes)
-        if fillResult == 'extended' then
-          anyExtended = true
-          isEdge = false
-        end
-      else
-        p = p:find()
-        pgrow[x] = p
-        if p.val.mass >= critMass then
-          p.val = p.val:withCritical(true)
-        end
-        isEdge = false
-      end
-      if isEdge then
-        ffi.copy(buffer[k], buffer[j], szPixel)
-        k = k + 1
-      else
-        local cordonKey = point16.fromXY(x, y)
-        self.cordon[cordonKey] = nil
-      end
-    end
-    self.numPixels = k
-  until not anyExtended
+  local n = pixelsort.wshed_prune(self.handle.targets[0],
+                                  options.critMass or 20)
+  assert(n >= 0, "wshed_prune failed")
+  return n
 end
---]]
 
 --[[
 function Watershed:getRoots()
@@ -226,16 +348,4 @@ end
 
 ctHandle = ffi.metatype('struct wshed_handle', iHandle)
 
-function iGridCell:__index(k)
-  if k == 'width' then
-    return self.maxX - self.minX + 1
-  elseif k == 'height' then
-    return self.maxY - self.minY + 1
-  else
-    return GridCell[k]
-  end
-end
-
-ctGridCell = ffi.metatype('struct wsGridCell', iGridCell)
-
 return Watershed
@@ -1,6 +1,7 @@
 #include "lua.h"
 #include "lauxlib.h"
 
+extern const char luaJIT_BC_Segment[];
 extern const char luaJIT_BC_Watershed[];
 extern const char luaJIT_BC_ffiu[];
 extern const char luaJIT_BC_lept_FPix[];
@@ -17,6 +18,7 @@ struct bc_preload
 	const char *bc;
 } bc_preloads[] =
 {
+	{"Segment", luaJIT_BC_Segment},
 	{"Watershed", luaJIT_BC_Watershed},
 	{"ffiu", luaJIT_BC_ffiu},
 	{"lept.FPix", luaJIT_BC_lept_FPix},
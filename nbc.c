@@ -0,0 +1,951 @@
+#include <math.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+#include <windows.h>
+typedef __int32 int32_t;
+typedef unsigned __int8 uint8_t;
+typedef unsigned __int32 uint32_t;
+typedef unsigned __int64 uint64_t;
+typedef HANDLE g_thread;
+#define THREAD_PROC DWORD WINAPI
+#define THREAD_PROC_RESULT 0
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+typedef pthread_t g_thread;
+#define THREAD_PROC void *
+#define THREAD_PROC_RESULT NULL
+#endif
+
+/* SSE2 row kernel for nbc_logWeights; -DGROD_NO_SIMD keeps it scalar */
+#ifndef GROD_NO_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define GROD_SSE2
+#include <emmintrin.h>
+#endif
+#endif
+
+#include "nbc_cdef.lua"
+#include "xmath_cdef.lua"
+
+#define MIN_CAP_FEATURES 64
+#define MIN_NUM_SLOTS 128
+#define NO_FEATURE (-1)
+
+/* Frees what the model owns (not what lies in its mapping) */
+static void freeArrays(struct nbc *self)
+{
+    free(self->classPops);
+    free(self->featurePops);
+    free(self->counts);
+    free(self->logLik);
+    free(self->slots);
+    free(self->keyOffsets);
+    free(self->keys);
+}
+
+static void unmap(struct nbc *self)
+{
+#ifdef _MSC_VER
+    UnmapViewOfFile(self->mapBase);
+#else
+    munmap(self->mapBase, self->mapSize);
+#endif
+    self->mapBase = NULL;
+}
+
+struct nbc *nbc_create(int32_t numClasses)
+{
+    struct nbc *self;
+    int32_t c;
+    uint32_t s;
+
+    if (numClasses <= 0) return NULL;
+    self = calloc(1, sizeof *self);
+    if (! self) return NULL;
+    self->numClasses = numClasses;
+    self->stride = (numClasses + 3) & ~3;
+    self->classPops = malloc(numClasses * sizeof *self->classPops);
+    self->classStale = calloc(numClasses, 1);
+    self->numSlots = MIN_NUM_SLOTS;
+    self->slots = malloc(MIN_NUM_SLOTS * sizeof *self->slots);
+    self->keyOffsets = calloc(1, sizeof *self->keyOffsets);
+    if (! self->classPops || ! self->classStale || ! self->slots ||
+        ! self->keyOffsets)
+    {
+        nbc_free(self);
+        return NULL;
+    }
+    for (c = 0; c < numClasses; ++ c)
+    {
+        self->classPops[c] = 1;
+    }
+    for (s = 0; s < self->numSlots; ++ s)
+    {
+        self->slots[s].id = NO_FEATURE;
+    }
+    self->totalPop = numClasses;
+    return self;
+}
+
+void nbc_free(struct nbc *self)
+{
+    if (! self) return;
+    if (self->mapBase)
+    {
+        unmap(self);
+    }
+    else
+    {
+        freeArrays(self);
+    }
+    free(self->rowStale);
+    free(self->classStale);
+    free(self);
+}
+
+/* Copies a mapped model's arrays to the heap, so that it can change.
+ * Returns 1 if out of memory (leaving the model mapped). */
+static int thaw(struct nbc *self)
+{
+    struct nbc copy;
+    size_t numFeatures = self->numFeatures, cells;
+    size_t keyBytes;
+
+    if (! self->mapBase) return 0;
+    cells = numFeatures * self->stride;
+    keyBytes = self->keyOffsets[numFeatures];
+    memset(&copy, 0, sizeof copy);
+    copy.classPops = malloc(self->numClasses * sizeof(uint32_t));
+    copy.featurePops = malloc(numFeatures * sizeof(uint32_t) + 1);
+    copy.counts = malloc(cells * sizeof(uint32_t) + 1);
+    copy.logLik = malloc(cells * sizeof(float) + 1);
+    copy.slots = malloc(self->numSlots * sizeof(struct nbcSlot));
+    copy.keyOffsets = malloc((numFeatures + 1) * sizeof(uint32_t));
+    copy.keys = malloc(keyBytes + 1);
+    if (! copy.classPops || ! copy.featurePops || ! copy.counts ||
+        ! copy.logLik || ! copy.slots || ! copy.keyOffsets || ! copy.keys)
+    {
+        freeArrays(&copy);
+        return 1;
+    }
+    memcpy(copy.classPops, self->classPops,
+           self->numClasses * sizeof(uint32_t));
+    memcpy(copy.featurePops, self->featurePops,
+           numFeatures * sizeof(uint32_t));
+    memcpy(copy.counts, self->counts, cells * sizeof(uint32_t));
+    memcpy(copy.logLik, self->logLik, cells * sizeof(float));
+    memcpy(copy.slots, self->slots,
+           self->numSlots * sizeof(struct nbcSlot));
+    memcpy(copy.keyOffsets, self->keyOffsets,
+           (numFeatures + 1) * sizeof(uint32_t));
+    memcpy(copy.keys, self->keys, keyBytes);
+    unmap(self);
+    self->classPops = copy.classPops;
+    self->featurePops = copy.featurePops;
+    self->counts = copy.counts;
+    self->logLik = copy.logLik;
+    self->slots = copy.slots;
+    self->keyOffsets = copy.keyOffsets;
+    self->keys = copy.keys;
+    self->keyCap = keyBytes;
+    self->capFeatures = self->numFeatures;
+    self->rowStale = calloc(self->capFeatures ? self->capFeatures : 1, 1);
+    return self->rowStale == NULL;
+}
+
+/* Makes room for at least one more row; returns 1 if out of memory */
+static int grow(struct nbc *self)
+{
+    size_t cap, rowBytes;
+    void *p;
+
+    if (self->numFeatures < self->capFeatures) return 0;
+    cap = self->capFeatures ? 2 * (size_t)self->capFeatures
+                            : MIN_CAP_FEATURES;
+    if (cap > 0x3fffffff) return 1;
+    rowBytes = self->stride * sizeof(uint32_t);
+    if (! (p = realloc(self->featurePops, cap * sizeof(uint32_t)))) return 1;
+    self->featurePops = p;
+    if (! (p = realloc(self->counts, cap * rowBytes))) return 1;
+    self->counts = p;
+    if (! (p = realloc(self->logLik, cap * self->stride * sizeof(float))))
+    {
+        return 1;
+    }
+    self->logLik = p;
+    if (! (p = realloc(self->rowStale, cap))) return 1;
+    self->rowStale = p;
+    if (! (p = realloc(self->keyOffsets, (cap + 1) * sizeof(uint32_t))))
+    {
+        return 1;
+    }
+    self->keyOffsets = p;
+    self->capFeatures = (int32_t)cap;
+    return 0;
+}
+
+/* FNV-1a over a feature's tag and key bytes */
+static uint32_t hashKey(int32_t tag, const uint8_t *key, int32_t len)
+{
+    uint32_t h = 2166136261U;
+    int32_t i;
+
+    h = (h ^ (uint8_t)tag) * 16777619U;
+    for (i = 0; i < len; ++ i)
+    {
+        h = (h ^ key[i]) * 16777619U;
+    }
+    return h;
+}
+
+/* The slot holding the key, or else the empty slot where it would go.
+ * Keys are stored as their tag byte followed by their bytes. */
+static struct nbcSlot *findSlot(const struct nbc *self, uint32_t hash,
+                                int32_t tag, const uint8_t *key,
+                                int32_t len)
+{
+    uint32_t mask = self->numSlots - 1, s = hash & mask;
+    struct nbcSlot *slot;
+    const uint8_t *stored;
+
+    for (;; s = (s + 1) & mask)
+    {
+        slot = &self->slots[s];
+        if (slot->id == NO_FEATURE) return slot;
+        if (slot->hash != hash) continue;
+        stored = &self->keys[self->keyOffsets[slot->id]];
+        if (self->keyOffsets[slot->id + 1] - self->keyOffsets[slot->id] ==
+                (uint32_t)len + 1 &&
+            stored[0] == (uint8_t)tag && memcmp(stored + 1, key, len) == 0)
+        {
+            return slot;
+        }
+    }
+}
+
+/* Doubles the hash index; returns 1 if out of memory */
+static int rehash(struct nbc *self)
+{
+    struct nbcSlot *old = self->slots, *slot;
+    uint32_t oldNum = self->numSlots, s, mask;
+
+    self->slots = malloc(2 * (size_t)oldNum * sizeof *self->slots);
+    if (! self->slots)
+    {
+        self->slots = old;
+        return 1;
+    }
+    self->numSlots = 2 * oldNum;
+    mask = self->numSlots - 1;
+    for (s = 0; s < self->numSlots; ++ s)
+    {
+        self->slots[s].id = NO_FEATURE;
+    }
+    for (s = 0; s < oldNum; ++ s)
+    {
+        if (old[s].id == NO_FEATURE) continue;
+        slot = &self->slots[old[s].hash & mask];
+        while (slot->id != NO_FEATURE)
+        {
+            slot = &self->slots[(slot - self->slots + 1) & mask];
+        }
+        *slot = old[s];
+    }
+    free(old);
+    return 0;
+}
+
+int32_t nbc_findFeature(const struct nbc *self, int32_t tag,
+                        const char *key, int32_t len)
+{
+    const uint8_t *k = (const uint8_t *)key;
+    return findSlot(self, hashKey(tag, k, len), tag, k, len)->id;
+}
+
+int32_t nbc_addFeature(struct nbc *self, int32_t tag,
+                       const char *key, int32_t len)
+{
+    const uint8_t *k = (const uint8_t *)key;
+    uint32_t hash = hashKey(tag, k, len);
+    struct nbcSlot *slot;
+    size_t row, used, need;
+    int32_t f;
+    void *p;
+
+    if (len < 0) return -1;
+    slot = findSlot(self, hash, tag, k, len);
+    if (slot->id != NO_FEATURE) return slot->id;
+    if (thaw(self) || grow(self)) return -1;
+    used = self->keyOffsets[self->numFeatures];
+    need = used + len + 1;
+    if (need > 0xffffffffU) return -1;
+    if (need > self->keyCap)
+    {
+        size_t cap = self->keyCap ? 2 * self->keyCap : 1024;
+        if (cap < need) cap = need;
+        if (! (p = realloc(self->keys, cap))) return -1;
+        self->keys = p;
+        self->keyCap = cap;
+    }
+    if (2 * ((size_t)self->numFeatures + 1) > self->numSlots)
+    {
+        if (rehash(self)) return -1;
+    }
+    /* The index may have moved (thawed or rehashed) */
+    slot = findSlot(self, hash, tag, k, len);
+    f = self->numFeatures ++;
+    self->keys[used] = (uint8_t)tag;
+    memcpy(&self->keys[used + 1], key, len);
+    self->keyOffsets[f + 1] = (uint32_t)need;
+    slot->hash = hash;
+    slot->id = f;
+    row = (size_t)f * self->stride;
+    self->featurePops[f] = 0;
+    memset(&self->counts[row], 0, self->stride * sizeof *self->counts);
+    memset(&self->logLik[row], 0, self->stride * sizeof *self->logLik);
+    self->rowStale[f] = 1;
+    self->anyStale = 1;
+    return f;
+}
+
+int nbc_train1(struct nbc *self, const int32_t *ids, int32_t n, int32_t cls)
+{
+    int32_t k;
+
+    if (cls < 0 || cls >= self->numClasses || n < 0) return 1;
+    for (k = 0; k < n; ++ k)
+    {
+        if (ids[k] < 0 || ids[k] >= self->numFeatures) return 1;
+    }
+    if (thaw(self)) return 1;
+    ++ self->classPops[cls];
+    ++ self->totalPop;
+    /* The class's smoothing term, so its whole column, changes */
+    self->classStale[cls] = 1;
+    for (k = 0; k < n; ++ k)
+    {
+        ++ self->counts[(size_t)ids[k] * self->stride + cls];
+        ++ self->featurePops[ids[k]];
+        self->rowStale[ids[k]] = 1;
+    }
+    self->anyStale = 1;
+    return 0;
+}
+
+/* log P(feature f | class c), with counts smoothed by half the class's
+ * share of a sample */
+static float logLikelihood(const struct nbc *self, int32_t f, int32_t c)
+{
+    double smooth = .5 * self->classPops[c] / self->numClasses;
+    double count = self->counts[(size_t)f * self->stride + c];
+    double with = count + smooth;
+    double without = self->featurePops[f] - count + smooth;
+    return (float)log(with / (with + without));
+}
+
+int nbc_refresh(struct nbc *self)
+{
+    int32_t f, c;
+    float *row;
+
+    if (! self->anyStale) return 0;
+    for (f = 0; f < self->numFeatures; ++ f)
+    {
+        row = &self->logLik[(size_t)f * self->stride];
+        for (c = 0; c < self->numClasses; ++ c)
+        {
+            if (self->rowStale[f] || self->classStale[c])
+            {
+                row[c] = logLikelihood(self, f, c);
+            }
+        }
+        self->rowStale[f] = 0;
+    }
+    memset(self->classStale, 0, self->numClasses);
+    self->anyStale = 0;
+    return 0;
+}
+
+/* out[0..n-1] += w * row[0..n-1], in double */
+static void addRow(double *out, const float *row, double w, int32_t n)
+{
+    int32_t c = 0;
+#ifdef GROD_SSE2
+    __m128d vw = _mm_set1_pd(w);
+    __m128 r;
+
+    for (; c + 4 <= n; c += 4)
+    {
+        r = _mm_loadu_ps(row + c);
+        _mm_storeu_pd(out + c, _mm_add_pd(_mm_loadu_pd(out + c),
+                                          _mm_mul_pd(_mm_cvtps_pd(r), vw)));
+        r = _mm_movehl_ps(r, r);
+        _mm_storeu_pd(out + c + 2,
+                      _mm_add_pd(_mm_loadu_pd(out + c + 2),
+                                 _mm_mul_pd(_mm_cvtps_pd(r), vw)));
+    }
+#endif
+    for (; c < n; ++ c)
+    {
+        out[c] += w * row[c];
+    }
+}
+
+/* nbc_logWeights without the refresh, so safe on several threads */
+static void sumLogWeights(const struct nbc *self,
+                          const int32_t *ids, const double *weights,
+                          int32_t n, const double *logPriors, double *out)
+{
+    int32_t c, k;
+
+    for (c = 0; c < self->numClasses; ++ c)
+    {
+        out[c] = logPriors ? logPriors[c] : log((double)self->classPops[c]);
+    }
+    for (k = 0; k < n; ++ k)
+    {
+        if (ids[k] < 0 || ids[k] >= self->numFeatures) continue;
+        addRow(out, &self->logLik[(size_t)ids[k] * self->stride],
+               weights ? weights[k] : 1.0, self->numClasses);
+    }
+}
+
+int nbc_logWeights(struct nbc *self,
+                   const int32_t *ids, const double *weights, int32_t n,
+                   const double *logPriors, double *out)
+{
+    nbc_refresh(self);
+    sumLogWeights(self, ids, weights, n, logPriors, out);
+    return 0;
+}
+
+/* A run of samples from a batch, for one thread.  Training counts into
+ * arrays of the job's own, except for job 0, which counts straight into
+ * the model (and marks what it changes stale). */
+struct nbcJob
+{
+    struct nbc *model;
+    const int32_t *offsets, *ids;
+    int32_t first, last;        /* Samples first..last-1 */
+    /* Training */
+    const int32_t *classes;
+    uint32_t *classPops, *featurePops, *counts;
+    /* Classifying */
+    const double *weights, *logPriors;
+    double *out;
+};
+
+static THREAD_PROC trainJob(void *arg)
+{
+    struct nbcJob *job = arg;
+    struct nbc *model = job->model;
+    int32_t s, k, cls, id;
+    int direct = job->counts == model->counts;
+
+    for (s = job->first; s < job->last; ++ s)
+    {
+        cls = job->classes[s];
+        ++ job->classPops[cls];
+        if (direct) model->classStale[cls] = 1;
+        for (k = job->offsets[s]; k < job->offsets[s + 1]; ++ k)
+        {
+            id = job->ids[k];
+            ++ job->counts[(size_t)id * model->stride + cls];
+            ++ job->featurePops[id];
+            if (direct) model->rowStale[id] = 1;
+        }
+    }
+    return THREAD_PROC_RESULT;
+}
+
+static THREAD_PROC classifyJob(void *arg)
+{
+    struct nbcJob *job = arg;
+    const struct nbc *model = job->model;
+    int32_t s, begin;
+    double *row;
+
+    for (s = job->first; s < job->last; ++ s)
+    {
+        begin = job->offsets[s];
+        row = &job->out[(size_t)s * model->numClasses];
+        sumLogWeights(model, &job->ids[begin],
+                      job->weights ? &job->weights[begin] : NULL,
+                      job->offsets[s + 1] - begin, job->logPriors, row);
+        xmath_softmax(row, model->numClasses, row);
+    }
+    return THREAD_PROC_RESULT;
+}
+
+#ifdef _MSC_VER
+typedef LPTHREAD_START_ROUTINE jobProc;
+#else
+typedef void *(*jobProc)(void *);
+#endif
+
+static int startThread(g_thread *thread, jobProc proc, struct nbcJob *job)
+{
+#ifdef _MSC_VER
+    *thread = CreateThread(NULL, 0, proc, job, 0, NULL);
+    return *thread != NULL;
+#else
+    return pthread_create(thread, NULL, proc, job) == 0;
+#endif
+}
+
+static void joinThread(g_thread thread)
+{
+#ifdef _MSC_VER
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+/* Runs jobs[0..numJobs-1], job 0 on the calling thread.  A job whose
+ * thread cannot be started runs on the calling thread too. */
+static void runJobs(struct nbcJob *jobs, int32_t numJobs, jobProc proc)
+{
+    g_thread *threads = calloc(numJobs, sizeof *threads);
+    int *started = calloc(numJobs, sizeof *started);
+    int32_t t;
+
+    for (t = 1; t < numJobs && threads && started; ++ t)
+    {
+        started[t] = startThread(&threads[t], proc, &jobs[t]);
+    }
+    proc(&jobs[0]);
+    for (t = 1; t < numJobs; ++ t)
+    {
+        if (started && started[t])
+        {
+            joinThread(threads[t]);
+        }
+        else
+        {
+            proc(&jobs[t]);
+        }
+    }
+    free(threads);
+    free(started);
+}
+
+/* Splits numSamples samples evenly among numJobs jobs */
+static struct nbcJob *newJobs(struct nbc *self, const int32_t *offsets,
+                              const int32_t *ids, int32_t numSamples,
+                              int32_t numJobs)
+{
+    struct nbcJob *jobs = calloc(numJobs, sizeof *jobs);
+    int32_t t;
+
+    if (! jobs) return NULL;
+    for (t = 0; t < numJobs; ++ t)
+    {
+        jobs[t].model = self;
+        jobs[t].offsets = offsets;
+        jobs[t].ids = ids;
+        jobs[t].first = (int32_t)((double)numSamples * t / numJobs);
+        jobs[t].last = (int32_t)((double)numSamples * (t + 1) / numJobs);
+    }
+    return jobs;
+}
+
+static int32_t clampThreads(int32_t numThreads, int32_t numSamples)
+{
+    if (numThreads > numSamples) numThreads = numSamples;
+    return numThreads < 1 ? 1 : numThreads;
+}
+
+/* Adds job's counts into the model, marking what they change stale */
+static void mergeShard(struct nbc *self, struct nbcJob *job)
+{
+    int32_t f, c;
+    size_t row;
+
+    for (c = 0; c < self->numClasses; ++ c)
+    {
+        if (! job->classPops[c]) continue;
+        self->classPops[c] += job->classPops[c];
+        self->classStale[c] = 1;
+    }
+    for (f = 0; f < self->numFeatures; ++ f)
+    {
+        if (! job->featurePops[f]) continue;
+        self->featurePops[f] += job->featurePops[f];
+        self->rowStale[f] = 1;
+        row = (size_t)f * self->stride;
+        for (c = 0; c < self->numClasses; ++ c)
+        {
+            self->counts[row + c] += job->counts[row + c];
+        }
+    }
+}
+
+static void freeShard(struct nbcJob *job)
+{
+    free(job->classPops);
+    free(job->featurePops);
+    free(job->counts);
+}
+
+int nbc_trainBatch(struct nbc *self, const int32_t *offsets,
+                   const int32_t *ids, const int32_t *classes,
+                   int32_t numSamples, int32_t numThreads)
+{
+    struct nbcJob *jobs;
+    int32_t s, k, t, numJobs;
+
+    if (numSamples < 0 || offsets[0] < 0) return 1;
+    for (s = 0; s < numSamples; ++ s)
+    {
+        if (classes[s] < 0 || classes[s] >= self->numClasses) return 1;
+        if (offsets[s + 1] < offsets[s]) return 1;
+    }
+    for (k = offsets[0]; k < offsets[numSamples]; ++ k)
+    {
+        if (ids[k] < 0 || ids[k] >= self->numFeatures) return 1;
+    }
+    if (thaw(self)) return 1;
+    numJobs = clampThreads(numThreads, numSamples);
+    jobs = newJobs(self, offsets, ids, numSamples, numJobs);
+    if (! jobs) return 1;
+    for (t = 0; t < numJobs; ++ t)
+    {
+        jobs[t].classes = classes;
+        if (t == 0)
+        {
+            jobs[t].classPops = self->classPops;
+            jobs[t].featurePops = self->featurePops;
+            jobs[t].counts = self->counts;
+            continue;
+        }
+        jobs[t].classPops = calloc(self->numClasses, sizeof(uint32_t));
+        jobs[t].featurePops = calloc(self->numFeatures, sizeof(uint32_t));
+        jobs[t].counts = calloc((size_t)self->numFeatures * self->stride,
+                                sizeof(uint32_t));
+        if (! jobs[t].classPops || ! jobs[t].featurePops ||
+            (! jobs[t].counts && self->numFeatures))
+        {
+            /* Out of memory for shards: the jobs so far take the rest */
+            freeShard(&jobs[t]);
+            jobs[t - 1].last = numSamples;
+            numJobs = t;
+            break;
+        }
+    }
+    runJobs(jobs, numJobs, trainJob);
+    for (t = 1; t < numJobs; ++ t)
+    {
+        mergeShard(self, &jobs[t]);
+        freeShard(&jobs[t]);
+    }
+    self->totalPop += numSamples;
+    self->anyStale = 1;
+    free(jobs);
+    return 0;
+}
+
+int nbc_classifyBatch(struct nbc *self, const int32_t *offsets,
+                      const int32_t *ids, const double *weights,
+                      int32_t numSamples, const double *logPriors,
+                      int32_t numThreads, double *out)
+{
+    struct nbcJob *jobs;
+    int32_t s, t, numJobs;
+
+    if (numSamples < 0 || offsets[0] < 0) return 1;
+    for (s = 0; s < numSamples; ++ s)
+    {
+        if (offsets[s + 1] < offsets[s]) return 1;
+    }
+    nbc_refresh(self);
+    numJobs = clampThreads(numThreads, numSamples);
+    jobs = newJobs(self, offsets, ids, numSamples, numJobs);
+    if (! jobs) return 1;
+    for (t = 0; t < numJobs; ++ t)
+    {
+        jobs[t].weights = weights;
+        jobs[t].logPriors = logPriors;
+        jobs[t].out = out;
+    }
+    runJobs(jobs, numJobs, classifyJob);
+    free(jobs);
+    return 0;
+}
+
+/*
+ * Model files.  A header is followed by the class and feature populations,
+ * the count and log-likelihood matrices, the hash index and the feature
+ * keys, each at a 16-byte aligned offset, so that nbc_load can map the
+ * file and use them where they lie.  The layout is that of the host
+ * (sizes are checked on load, byte order is not).
+ */
+#define NBC_FILE_MAGIC 0x3143424eU      /* "NBC1" */
+#define NBC_FILE_VERSION 1
+#define FILE_ALIGN(n) (((n) + 15) & ~(uint64_t)15)
+
+struct nbcFileHeader
+{
+    uint32_t magic, version;
+    uint32_t headerSize, slotSize;
+    int32_t numClasses, numFeatures, stride;
+    uint32_t totalPop, numSlots, keyBytes;
+    uint64_t classPopsOffset, featurePopsOffset, countsOffset, logLikOffset;
+    uint64_t slotsOffset, keyOffsetsOffset, keysOffset;
+    uint64_t size;
+};
+
+/* Fills in the offsets and size from the counts */
+static void fileLayout(struct nbcFileHeader *hdr)
+{
+    uint64_t cells = (uint64_t)hdr->numFeatures * hdr->stride;
+    uint64_t off = FILE_ALIGN(sizeof (*hdr));
+
+    hdr->classPopsOffset = off;
+    off += FILE_ALIGN(hdr->numClasses * sizeof(uint32_t));
+    hdr->featurePopsOffset = off;
+    off += FILE_ALIGN(hdr->numFeatures * sizeof(uint32_t));
+    hdr->countsOffset = off;
+    off += FILE_ALIGN(cells * sizeof(uint32_t));
+    hdr->logLikOffset = off;
+    off += FILE_ALIGN(cells * sizeof(float));
+    hdr->slotsOffset = off;
+    off += FILE_ALIGN(hdr->numSlots * sizeof(struct nbcSlot));
+    hdr->keyOffsetsOffset = off;
+    off += FILE_ALIGN((hdr->numFeatures + 1) * sizeof(uint32_t));
+    hdr->keysOffset = off;
+    off += FILE_ALIGN(hdr->keyBytes);
+    hdr->size = off;
+}
+
+/* Writes size bytes and the zeros padding them to a 16-byte boundary */
+static int writeSection(FILE *file, const void *data, uint64_t size)
+{
+    static const char zeros[16];
+    size_t pad = (size_t)(FILE_ALIGN(size) - size);
+
+    if (size && fwrite(data, 1, (size_t)size, file) != size) return 1;
+    return pad && fwrite(zeros, 1, pad, file) != pad;
+}
+
+/* Replaces path with the file at tmp; 0 on success */
+static int replaceFile(const char *tmp, const char *path)
+{
+#ifdef _MSC_VER
+    return ! MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING);
+#else
+    return rename(tmp, path) != 0;
+#endif
+}
+
+/*
+ * The model is written to path.tmp and then renamed over path, so that a
+ * mapping of the old file (this model's own, or another process's) keeps
+ * its pages rather than seeing the file truncated under it.  Windows
+ * will not replace a file that is mapped, so there the model lets go of
+ * its own mapping first.
+ */
+int nbc_save(struct nbc *self, const char *path)
+{
+    struct nbcFileHeader hdr;
+    uint64_t cells = (uint64_t)self->numFeatures * self->stride;
+    FILE *file;
+    char *tmp;
+    int err;
+
+#ifdef _MSC_VER
+    if (thaw(self)) return 1;
+#endif
+    nbc_refresh(self);
+    memset(&hdr, 0, sizeof hdr);
+    hdr.magic = NBC_FILE_MAGIC;
+    hdr.version = NBC_FILE_VERSION;
+    hdr.headerSize = sizeof hdr;
+    hdr.slotSize = sizeof (struct nbcSlot);
+    hdr.numClasses = self->numClasses;
+    hdr.numFeatures = self->numFeatures;
+    hdr.stride = self->stride;
+    hdr.totalPop = self->totalPop;
+    hdr.numSlots = self->numSlots;
+    hdr.keyBytes = self->keyOffsets[self->numFeatures];
+    fileLayout(&hdr);
+    tmp = malloc(strlen(path) + sizeof ".tmp");
+    if (! tmp) return 1;
+    strcpy(tmp, path);
+    strcat(tmp, ".tmp");
+    file = fopen(tmp, "wb");
+    if (! file)
+    {
+        free(tmp);
+        return 1;
+    }
+    err = writeSection(file, &hdr, sizeof hdr) ||
+          writeSection(file, self->classPops,
+                       hdr.numClasses * sizeof(uint32_t)) ||
+          writeSection(file, self->featurePops,
+                       hdr.numFeatures * sizeof(uint32_t)) ||
+          writeSection(file, self->counts, cells * sizeof(uint32_t)) ||
+          writeSection(file, self->logLik, cells * sizeof(float)) ||
+          writeSection(file, self->slots,
+                       hdr.numSlots * sizeof(struct nbcSlot)) ||
+          writeSection(file, self->keyOffsets,
+                       (hdr.numFeatures + 1) * sizeof(uint32_t)) ||
+          writeSection(file, self->keys, hdr.keyBytes);
+    err = (fclose(file) != 0) || err || replaceFile(tmp, path);
+    if (err) remove(tmp);
+    free(tmp);
+    return err;
+}
+
+/* Maps the whole of path read-only; NULL if it cannot */
+static void *mapFile(const char *path, size_t *size)
+{
+#ifdef _MSC_VER
+    HANDLE file, mapping;
+    LARGE_INTEGER fileSize;
+    void *base = NULL;
+
+    file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                       OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return NULL;
+    if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0 &&
+        (ULONGLONG)fileSize.QuadPart <= (size_t)-1)
+    {
+        mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping)
+        {
+            base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+        *size = (size_t)fileSize.QuadPart;
+    }
+    CloseHandle(file);
+    return base;
+#else
+    struct stat st;
+    void *base = NULL;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0 &&
+        (unsigned long long)st.st_size <= (size_t)-1)
+    {
+        base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED) base = NULL;
+        *size = (size_t)st.st_size;
+    }
+    close(fd);
+    return base;
+#endif
+}
+
+/* Whether hdr is one this build wrote, and describes a file of size bytes */
+static int validHeader(const struct nbcFileHeader *hdr, size_t size)
+{
+    struct nbcFileHeader layout;
+
+    if (size < sizeof *hdr) return 0;
+    if (hdr->magic != NBC_FILE_MAGIC ||
+        hdr->version != NBC_FILE_VERSION ||
+        hdr->headerSize != sizeof *hdr ||
+        hdr->slotSize != sizeof (struct nbcSlot))
+    {
+        return 0;
+    }
+    if (hdr->numClasses <= 0 || hdr->numFeatures < 0 ||
+        hdr->stride != ((hdr->numClasses + 3) & ~3) ||
+        hdr->numSlots == 0 ||
+        hdr->numSlots < 2 * (uint64_t)hdr->numFeatures ||
+        (hdr->numSlots & (hdr->numSlots - 1)) != 0)
+    {
+        return 0;
+    }
+    layout = *hdr;
+    fileLayout(&layout);
+    return memcmp(&layout, hdr, sizeof layout) == 0 && hdr->size <= size;
+}
+
+/*
+ * Whether the key offsets and hash index of the file at base (whose
+ * header is valid) stay within their sections, so that lookups cannot
+ * read past them or probe forever.  Linear in the number of slots.
+ */
+static int validIndex(const char *base)
+{
+    const struct nbcFileHeader *hdr = (const struct nbcFileHeader *)base;
+    const uint32_t *keyOffsets =
+        (const uint32_t *)(base + hdr->keyOffsetsOffset);
+    const struct nbcSlot *slots =
+        (const struct nbcSlot *)(base + hdr->slotsOffset);
+    uint64_t s, used = 0;
+    int32_t f;
+
+    if (keyOffsets[0] != 0) return 0;
+    for (f = 0; f < hdr->numFeatures; f ++)
+    {
+        /* Each key holds at least its tag byte */
+        if (keyOffsets[f + 1] <= keyOffsets[f]) return 0;
+    }
+    for (s = 0; s < hdr->numSlots; s ++)
+    {
+        if (slots[s].id == NO_FEATURE) continue;
+        if (slots[s].id < 0 || slots[s].id >= hdr->numFeatures) return 0;
+        used ++;
+    }
+    /* numSlots >= 2 * numFeatures, so this leaves an empty slot */
+    return used <= (uint64_t)hdr->numFeatures;
+}
+
+struct nbc *nbc_load(const char *path, int verify)
+{
+    struct nbc *self;
+    const struct nbcFileHeader *hdr;
+    char *base;
+    size_t size = 0;
+
+    self = calloc(1, sizeof *self);
+    if (! self) return NULL;
+    self->mapBase = base = mapFile(path, &size);
+    self->mapSize = size;
+    if (! base)
+    {
+        free(self);
+        return NULL;
+    }
+    hdr = (const struct nbcFileHeader *)base;
+    if (! validHeader(hdr, size) ||
+        ((const uint32_t *)(base + hdr->keyOffsetsOffset))
+            [hdr->numFeatures] != hdr->keyBytes ||
+        (verify && ! validIndex(base)) ||
+        ! (self->classStale = calloc(hdr->numClasses, 1)))
+    {
+        nbc_free(self);
+        return NULL;
+    }
+    self->numClasses = hdr->numClasses;
+    self->numFeatures = hdr->numFeatures;
+    self->capFeatures = hdr->numFeatures;
+    self->stride = hdr->stride;
+    self->totalPop = hdr->totalPop;
+    self->numSlots = hdr->numSlots;
+    self->classPops = (uint32_t *)(base + hdr->classPopsOffset);
+    self->featurePops = (uint32_t *)(base + hdr->featurePopsOffset);
+    self->counts = (uint32_t *)(base + hdr->countsOffset);
+    self->logLik = (float *)(base + hdr->logLikOffset);
+    self->slots = (struct nbcSlot *)(base + hdr->slotsOffset);
+    self->keyOffsets = (uint32_t *)(base + hdr->keyOffsetsOffset);
+    self->keys = (uint8_t *)(base + hdr->keysOffset);
+    self->keyCap = hdr->keyBytes;
+    return self;
+}
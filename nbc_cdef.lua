@@ -0,0 +1,112 @@
+#include "cdef.h"
+tonumber(((function(m)--[[] ])))/*]]
+
+local ffi = require 'ffi'
+local ffilib = require 'ffilib'
+
+ffi.cdef("/"..[[**/
+
+// A slot of a model's hash index of feature keys (id -1 if empty)
+struct nbcSlot
+{
+    uint32_t hash;
+    int32_t id;
+};
+
+// Naive Bayes model over dense feature IDs 0..numFeatures-1 and classes
+// 0..numClasses-1.  Rows of counts and logLik are stride entries apart.
+// A model from nbc_load keeps its arrays in the mapped file until it is
+// first changed, when they are copied to the heap.
+struct nbc
+{
+    int32_t numClasses;
+    int32_t numFeatures;
+    int32_t capFeatures;    // Rows allocated
+    int32_t stride;         // numClasses rounded up to a multiple of 4
+    uint32_t totalPop;
+    uint32_t *classPops;    // Samples per class, each starting at 1
+    uint32_t *featurePops;  // Samples per feature
+    uint32_t *counts;       // Samples per feature and class
+    float *logLik;          // log P(feature | class), kept by nbc_refresh
+    uint8_t *rowStale;      // Features whose logLik rows need recomputing
+    uint8_t *classStale;    // Classes whose logLik columns do
+    int32_t anyStale;
+    uint32_t numSlots;      // A power of 2, at least twice numFeatures
+    struct nbcSlot *slots;
+    uint32_t *keyOffsets;   // Feature f's key is keys[keyOffsets[f]] up to
+    uint8_t *keys;          // keys[keyOffsets[f+1]]: its tag, then bytes
+    size_t keyCap;
+    void *mapBase;          // Mapping of the file loaded from, if any
+    size_t mapSize;
+};
+
+struct nbc *nbc_create(int32_t numClasses);
+void nbc_free(struct nbc *model);
+
+// The ID of the feature with key[0..len-1] and tag (which tells apart
+// keys of different types with the same bytes), or -1 if there is none
+int32_t nbc_findFeature(const struct nbc *model, int32_t tag,
+                        const char *key, int32_t len);
+
+// As nbc_findFeature, but adds the feature if there is none.  Returns -1
+// if out of memory.
+int32_t nbc_addFeature(struct nbc *model, int32_t tag,
+                       const char *key, int32_t len);
+
+// Counts one sample of class cls having features ids[0..n-1].  Only the
+// log-likelihoods this changes are marked stale.  Returns 0, or 1 for a
+// bad class or feature ID.
+int nbc_train1(struct nbc *model, const int32_t *ids, int32_t n,
+               int32_t cls);
+
+// Recomputes the stale log-likelihoods.  Returns 0.
+int nbc_refresh(struct nbc *model);
+
+// out[c] = logPriors[c] (or log classPops[c] if logPriors is NULL) plus the
+// sum over k of weights[k] (1 if weights is NULL) times log P(ids[k] | c),
+// for each class c.  IDs outside 0..numFeatures-1 are skipped, as for a
+// feature never trained on.  Refreshes first if anything is stale, so only
+// one thread may call this until nbc_refresh has been.  Returns 0.
+int nbc_logWeights(struct nbc *model,
+                   const int32_t *ids, const double *weights, int32_t n,
+                   const double *logPriors, double *out);
+
+// Trains on a batch of numSamples samples in CSR form: sample s has
+// class classes[s] and features ids[offsets[s]..offsets[s+1]-1].  Up to
+// numThreads threads count runs of samples, each into counts of its own
+// (but the first, which counts into the model), which are summed at the
+// end.  Returns 0, or 1 for a bad class, feature ID or offset (having
+// counted nothing) or if out of memory.
+int nbc_trainBatch(struct nbc *model, const int32_t *offsets,
+                   const int32_t *ids, const int32_t *classes,
+                   int32_t numSamples, int32_t numThreads);
+
+// The posteriors of numSamples samples in CSR form (as for
+// nbc_trainBatch), with feature k scaled by weights[k] if weights is not
+// NULL, into out[s * numClasses + c], on up to numThreads threads.
+// Returns 0, or 1 for a bad offset or if out of memory.
+int nbc_classifyBatch(struct nbc *model, const int32_t *offsets,
+                      const int32_t *ids, const double *weights,
+                      int32_t numSamples, const double *logPriors,
+                      int32_t numThreads, double *out);
+
+// Writes the model (refreshed first) to a file at path, in the host's
+// layout, by way of path.tmp, which is renamed over path once complete.
+// Models mapped from the old file (even this one) are left intact.
+// Returns 0, or 1 if the file cannot be written.
+int nbc_save(struct nbc *model, const char *path);
+
+// Maps a file written by nbc_save read-only and shared, without reading
+// more of it than the header, so that it loads in constant time and
+// processes loading the same file share its pages.  NULL if the file
+// cannot be mapped or is not a model file of this version and layout.
+// Only the header is checked, so a file whose body is damaged can make
+// later calls read out of bounds; if verify is nonzero, the key offsets
+// and hash index are checked too (in time linear in the file's size)
+// and such a file is refused.
+struct nbc *nbc_load(const char *path, int verify);
+
+// vim: filetype=c:
+/*]])
+package.loaded[m] = ffilib(m)
+end)(...)))--*/
@@ -2,13 +2,31 @@
 #include <cstddef>
 #include <iostream>
 #include <tesseract/baseapi.h>
+#include "leptonica/allheaders.h"
 
 typedef unsigned char uint8_t;
 typedef unsigned int uint32_t;
 
+#ifdef _MSC_VER
+#define NOMINMAX
+#include <windows.h>
+typedef unsigned __int64 ocr_uint64;
+typedef HANDLE ocr_thread;
+#define THREAD_PROC DWORD WINAPI
+#define THREAD_PROC_RESULT 0
+#else
+#include <pthread.h>
+#include <stdint.h>
+typedef uint64_t ocr_uint64;
+typedef pthread_t ocr_thread;
+#define THREAD_PROC void *
+#define THREAD_PROC_RESULT NULL
+#endif
+
 extern "C"
 {
 #include "libyflood.cdef"
+#include "ocr_cdef.lua"
 }
 
 using namespace std;
@@ -19,11 +37,273 @@ struct ocr
     void *pBaseAPI;
 };
 
+struct ocr_pool
+{
+    int32_t numEngines;
+    TessBaseAPI **engines;
+};
+
 namespace
 {
     const char ALPHANUMERICS[] =
        "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
     const uint32_t TERM_PROB_BITS = 0x7fc00000u;
+
+    void setSingleCharMode(TessBaseAPI *tess)
+    {
+        tess->SetPageSegMode(PSM_SINGLE_CHAR);
+        tess->SetVariable("tessedit_char_whitelist", ALPHANUMERICS);
+        // Keeps the classifier's alternatives for ChoiceIterator
+        tess->SetVariable("save_blob_choices", "T");
+    }
+
+    bool isGuess(const char *text)
+    {
+        return text && '0' <= text[0] && text[0] <= 'z' && text[1] == '\0';
+    }
+
+    // Recognizes the current image (or rectangle of it) as one character
+    // and fills in up to guessCapacity guesses, best first, from the
+    // classifier's choices for the first symbol, each with its own
+    // confidence.  If there is room, a guess with a NaN prob follows.
+    void readGuesses(TessBaseAPI *tess,
+                     struct char_guess *guesses, int32_t guessCapacity)
+    {
+        int32_t nrOut = 0;
+        if (tess->Recognize(NULL) == 0)
+        {
+            ResultIterator *it = tess->GetIterator();
+            if (it && ! it->Empty(RIL_SYMBOL))
+            {
+                ChoiceIterator choice(*it);
+                for (bool more = true; more && nrOut < guessCapacity;
+                     more = choice.Next())
+                {
+                    const char *text = choice.GetUTF8Text();
+                    if (! isGuess(text)) continue;
+                    int32_t i = 0;
+                    while (i < nrOut && guesses[i].codePoint != text[0]) ++ i;
+                    if (i < nrOut) continue;    // Same character again
+                    float prob = 0.01f * choice.Confidence();
+                    guesses[nrOut].codePoint = text[0];
+                    guesses[nrOut].prob = std::max(0.0f, std::min(prob, 1.0f));
+                    ++ nrOut;
+                }
+            }
+            delete it;
+        }
+        if (nrOut < guessCapacity)
+        {
+            guesses[nrOut].codePoint = '\0';
+            memcpy((void *)&guesses[nrOut].prob,
+                   (const void *)&TERM_PROB_BITS, 4);
+        }
+    }
+
+    bool glyphsWithin(const ocr_glyph *glyphs, int32_t numGlyphs,
+                      int32_t width, int32_t height)
+    {
+        for (int32_t i = 0; i < numGlyphs; ++ i)
+        {
+            const ocr_glyph &g = glyphs[i];
+            if (g.x < 0 || g.y < 0 || g.width <= 0 || g.height <= 0 ||
+                g.x + g.width > width || g.y + g.height > height)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Gets the width and height of pix; false if it is not a valid image
+    bool pixDimensions(PIX *pix, int32_t *width, int32_t *height)
+    {
+        l_int32 w, h;
+        if (! pix || pixGetDimensions(pix, &w, &h, NULL) != 0) return false;
+        *width = w;
+        *height = h;
+        return true;
+    }
+
+    void readGlyph(TessBaseAPI *tess, const ocr_glyph &g,
+                   struct char_guess *guesses, int32_t guessCapacity)
+    {
+        tess->SetRectangle(g.x, g.y, g.width, g.height);
+        readGuesses(tess, guesses, guessCapacity);
+    }
+
+    // A batch shared out among a pool's engines.  Each worker owns a range
+    // of glyph indices, packed as begin << 32 | end so that it can be
+    // changed with one compare-and-swap: the owner takes glyphs from the
+    // front and, once it runs dry, steals half of another's from the back.
+    // Each glyph's guesses have slots of their own, so need no locking.
+    // If pixels is NULL, each engine's image has been set already.
+    struct poolBatch
+    {
+        const uint8_t *pixels;
+        int32_t width, height, yStride;
+        const ocr_glyph *glyphs;
+        char_guess *guesses;
+        int32_t guessCapacity;
+        int32_t numWorkers;
+        volatile ocr_uint64 *ranges;
+    };
+
+    struct poolWorker
+    {
+        poolBatch *batch;
+        TessBaseAPI *tess;
+        int32_t self;
+        ocr_thread thread;
+        bool started;
+    };
+
+    ocr_uint64 packRange(uint32_t begin, uint32_t end)
+    {
+        return (ocr_uint64)begin << 32 | end;
+    }
+
+    bool casRange(volatile ocr_uint64 *range,
+                  ocr_uint64 expected, ocr_uint64 desired)
+    {
+#ifdef _MSC_VER
+        return (ocr_uint64)InterlockedCompareExchange64(
+            (volatile LONGLONG *)range, (LONGLONG)desired,
+            (LONGLONG)expected) == expected;
+#else
+        return __sync_bool_compare_and_swap(range, expected, desired);
+#endif
+    }
+
+    // An atomic read (a plain one could tear on 32-bit targets)
+    ocr_uint64 loadRange(volatile ocr_uint64 *range)
+    {
+#ifdef _MSC_VER
+        return (ocr_uint64)InterlockedCompareExchange64(
+            (volatile LONGLONG *)range, 0, 0);
+#else
+        return __sync_fetch_and_add(range, 0);
+#endif
+    }
+
+    // Next glyph for worker self, or -1 once every range is empty
+    int32_t takeGlyph(poolBatch *batch, int32_t self)
+    {
+        volatile ocr_uint64 *own = &batch->ranges[self];
+        for (;;)
+        {
+            ocr_uint64 r = loadRange(own);
+            uint32_t begin = (uint32_t)(r >> 32), end = (uint32_t)r;
+            if (begin < end)
+            {
+                if (casRange(own, r, packRange(begin + 1, end)))
+                {
+                    return (int32_t)begin;
+                }
+                continue;
+            }
+            bool stole = false;
+            for (int32_t k = 1; k < batch->numWorkers && ! stole; ++ k)
+            {
+                volatile ocr_uint64 *victim =
+                    &batch->ranges[(self + k) % batch->numWorkers];
+                for (;;)
+                {
+                    ocr_uint64 v = loadRange(victim);
+                    uint32_t vBegin = (uint32_t)(v >> 32), vEnd = (uint32_t)v;
+                    if (vBegin >= vEnd) break;
+                    uint32_t mid = vEnd - (vEnd - vBegin + 1) / 2;
+                    if (casRange(victim, v, packRange(vBegin, mid)))
+                    {
+                        // Only the owner refills its own empty range
+                        while (! casRange(own, r, packRange(mid, vEnd)))
+                        {
+                            r = loadRange(own);
+                        }
+                        stole = true;
+                        break;
+                    }
+                }
+            }
+            if (! stole) return -1;
+        }
+    }
+
+    THREAD_PROC runWorker(void *arg)
+    {
+        poolWorker *worker = reinterpret_cast<poolWorker *>(arg);
+        poolBatch *batch = worker->batch;
+        if (batch->pixels)
+        {
+            worker->tess->SetImage(batch->pixels, batch->width,
+                                   batch->height, 1, batch->yStride);
+        }
+        for (int32_t i; (i = takeGlyph(batch, worker->self)) >= 0; )
+        {
+            readGlyph(worker->tess, batch->glyphs[i],
+                      &batch->guesses[i * batch->guessCapacity],
+                      batch->guessCapacity);
+        }
+        return THREAD_PROC_RESULT;
+    }
+
+    bool startWorker(poolWorker *worker)
+    {
+#ifdef _MSC_VER
+        worker->thread = CreateThread(NULL, 0, runWorker, worker, 0, NULL);
+        return worker->thread != NULL;
+#else
+        return pthread_create(&worker->thread, NULL, runWorker, worker) == 0;
+#endif
+    }
+
+    void joinWorker(ocr_thread thread)
+    {
+#ifdef _MSC_VER
+        WaitForSingleObject(thread, INFINITE);
+        CloseHandle(thread);
+#else
+        pthread_join(thread, NULL);
+#endif
+    }
+
+    // Shares batch out among the first batch.numWorkers engines of pool
+    // and returns once every glyph has been read
+    void runBatch(ocr_pool *pool, poolBatch &batch, int32_t numGlyphs)
+    {
+        int32_t numWorkers = batch.numWorkers;
+        batch.ranges = new volatile ocr_uint64[numWorkers];
+        poolWorker *workers = new poolWorker[numWorkers];
+        for (int32_t w = 0; w < numWorkers; ++ w)
+        {
+            batch.ranges[w] = packRange(
+                (uint32_t)((ocr_uint64)numGlyphs * w / numWorkers),
+                (uint32_t)((ocr_uint64)numGlyphs * (w + 1) / numWorkers));
+            workers[w].batch = &batch;
+            workers[w].tess = pool->engines[w];
+            workers[w].self = w;
+        }
+        // The calling thread is worker 0
+        for (int32_t w = 1; w < numWorkers; ++ w)
+        {
+            workers[w].started = startWorker(&workers[w]);
+        }
+        runWorker(&workers[0]);
+        for (int32_t w = 1; w < numWorkers; ++ w)
+        {
+            if (workers[w].started)
+            {
+                joinWorker(workers[w].thread);
+            }
+            else
+            {
+                // Its glyphs have likely been stolen already
+                runWorker(&workers[w]);
+            }
+        }
+        delete [] workers;
+        delete [] batch.ranges;
+    }
 }
 
 extern "C"
@@ -46,27 +326,180 @@ int yf_ocr_read(HOCR ocr,
                 struct char_guess *guesses,
                 int32_t guessCapacity)
 {
-    if (! pixels) return -500;
+    if (! pixels || ! guesses) return -500;
     if (xStride != 1) return -500;
+    if (guessCapacity <= 0) return -500;
     TessBaseAPI *tess = reinterpret_cast<TessBaseAPI *>(ocr->pBaseAPI);
     tess->Clear();
-    tess->SetPageSegMode(PSM_SINGLE_CHAR);
-    tess->SetVariable("tessedit_char_whitelist", ALPHANUMERICS);
+    setSingleCharMode(tess);
     tess->SetImage(pixels, width, height, 1, yStride);
-    char *utf8Text = tess->GetUTF8Text();
-    char *cp = utf8Text;
-    size_t nrOut = 0;
-    while (*cp == '\n') ++ cp;
-    if ('0' <= cp[0] && cp[0] <= 'z' &&
-        (cp[1] == '\n' || cp[1] == '\0'))
-    {
-        guesses[nrOut].codePoint = cp[0];
-        guesses[nrOut].prob = 0.01 * tess->MeanTextConf();
-        ++ nrOut;
-    }
-    guesses[nrOut].codePoint = '\0';
-    memcpy((void *)&guesses[nrOut].prob, (const void *)&TERM_PROB_BITS, 4);
-    delete utf8Text;
+    readGuesses(tess, guesses, guessCapacity);
+    return 0;
+}
+
+int yf_ocr_read_batch(HOCR ocr,
+                      const uint8_t *pixels,
+                      int32_t width, int32_t height, int32_t yStride,
+                      const struct ocr_glyph *glyphs, int32_t numGlyphs,
+                      struct char_guess *guesses,
+                      int32_t guessCapacity)
+{
+    if (! pixels || ! glyphs || ! guesses) return -500;
+    if (guessCapacity <= 0) return -500;
+    if (! glyphsWithin(glyphs, numGlyphs, width, height)) return -500;
+    TessBaseAPI *tess = reinterpret_cast<TessBaseAPI *>(ocr->pBaseAPI);
+    setSingleCharMode(tess);
+    // One image for the whole batch; each glyph is just a rectangle of it
+    tess->SetImage(pixels, width, height, 1, yStride);
+    for (int32_t i = 0; i < numGlyphs; ++ i)
+    {
+        readGlyph(tess, glyphs[i], &guesses[i * guessCapacity],
+                  guessCapacity);
+    }
+    return 0;
+}
+
+int yf_ocr_read_pix(HOCR ocr, PIX *pix, BOX *box,
+                    struct char_guess *guesses,
+                    int32_t guessCapacity)
+{
+    int32_t width, height;
+    if (! pixDimensions(pix, &width, &height)) return -500;
+    if (! guesses || guessCapacity <= 0) return -500;
+    l_int32 x = 0, y = 0, w = width, h = height;
+    if (box && boxGetGeometry(box, &x, &y, &w, &h) != 0) return -500;
+    if (x < 0 || y < 0 || w <= 0 || h <= 0 ||
+        x + w > width || y + h > height)
+    {
+        return -500;
+    }
+    TessBaseAPI *tess = reinterpret_cast<TessBaseAPI *>(ocr->pBaseAPI);
+    setSingleCharMode(tess);
+    // A clone of pix, not a copy of its pixels as SetImage(pixels...) makes
+    tess->SetImage(pix);
+    tess->SetRectangle(x, y, w, h);
+    readGuesses(tess, guesses, guessCapacity);
+    // Drops the clone, so that the engine does not keep pix alive
+    tess->Clear();
+    return 0;
+}
+
+int yf_ocr_read_pix_batch(HOCR ocr, PIX *pix,
+                          const struct ocr_glyph *glyphs, int32_t numGlyphs,
+                          struct char_guess *guesses,
+                          int32_t guessCapacity)
+{
+    int32_t width, height;
+    if (! pixDimensions(pix, &width, &height)) return -500;
+    if (! glyphs || ! guesses) return -500;
+    if (guessCapacity <= 0) return -500;
+    if (! glyphsWithin(glyphs, numGlyphs, width, height)) return -500;
+    TessBaseAPI *tess = reinterpret_cast<TessBaseAPI *>(ocr->pBaseAPI);
+    setSingleCharMode(tess);
+    tess->SetImage(pix);
+    for (int32_t i = 0; i < numGlyphs; ++ i)
+    {
+        readGlyph(tess, glyphs[i], &guesses[i * guessCapacity],
+                  guessCapacity);
+    }
+    tess->Clear();
+    return 0;
+}
+
+int yf_ocr_pool_new(const char *dataPath, int32_t numEngines,
+                    HOCRPOOL *dst)
+{
+    if (numEngines <= 0) return -500;
+    ocr_pool *pool = new ocr_pool;
+    pool->numEngines = 0;
+    pool->engines = new TessBaseAPI *[numEngines];
+    for (int32_t i = 0; i < numEngines; ++ i)
+    {
+        TessBaseAPI *tess = new TessBaseAPI;
+        pool->engines[pool->numEngines ++] = tess;
+        if (tess->Init(dataPath, "eng", OEM_TESSERACT_ONLY) != 0)
+        {
+            yf_ocr_pool_free(pool);
+            return -500;
+        }
+        setSingleCharMode(tess);
+    }
+    *dst = pool;
+    return 0;
+}
+
+int yf_ocr_pool_read_batch(HOCRPOOL pool,
+                           const uint8_t *pixels,
+                           int32_t width, int32_t height, int32_t yStride,
+                           const struct ocr_glyph *glyphs, int32_t numGlyphs,
+                           struct char_guess *guesses,
+                           int32_t guessCapacity)
+{
+    if (! pool || ! pixels || guessCapacity <= 0) return -500;
+    if (numGlyphs == 0) return 0;
+    if (numGlyphs < 0 || ! glyphs || ! guesses) return -500;
+    if (! glyphsWithin(glyphs, numGlyphs, width, height)) return -500;
+
+    poolBatch batch;
+    batch.pixels = pixels;
+    batch.width = width;
+    batch.height = height;
+    batch.yStride = yStride;
+    batch.glyphs = glyphs;
+    batch.guesses = guesses;
+    batch.guessCapacity = guessCapacity;
+    batch.numWorkers = std::min(pool->numEngines, numGlyphs);
+    runBatch(pool, batch, numGlyphs);
+    return 0;
+}
+
+int yf_ocr_pool_read_pix_batch(HOCRPOOL pool, PIX *pix,
+                               const struct ocr_glyph *glyphs,
+                               int32_t numGlyphs,
+                               struct char_guess *guesses,
+                               int32_t guessCapacity)
+{
+    int32_t width, height;
+    if (! pool || ! pixDimensions(pix, &width, &height)) return -500;
+    if (guessCapacity <= 0) return -500;
+    if (numGlyphs == 0) return 0;
+    if (numGlyphs < 0 || ! glyphs || ! guesses) return -500;
+    if (! glyphsWithin(glyphs, numGlyphs, width, height)) return -500;
+
+    poolBatch batch;
+    batch.pixels = NULL;
+    batch.width = width;
+    batch.height = height;
+    batch.yStride = 0;
+    batch.glyphs = glyphs;
+    batch.guesses = guesses;
+    batch.guessCapacity = guessCapacity;
+    batch.numWorkers = std::min(pool->numEngines, numGlyphs);
+    // Cloning pix bumps its reference count, which Leptonica does not do
+    // atomically, so every engine gets its clone on this thread
+    for (int32_t w = 0; w < batch.numWorkers; ++ w)
+    {
+        pool->engines[w]->SetImage(pix);
+    }
+    runBatch(pool, batch, numGlyphs);
+    for (int32_t w = 0; w < batch.numWorkers; ++ w)
+    {
+        pool->engines[w]->Clear();
+    }
+    return 0;
+}
+
+int yf_ocr_pool_free(HOCRPOOL pool)
+{
+    if (pool)
+    {
+        for (int32_t i = 0; i < pool->numEngines; ++ i)
+        {
+            delete pool->engines[i];
+        }
+        delete [] pool->engines;
+    }
+    delete pool;
     return 0;
 }
 
@@ -0,0 +1,77 @@
+#include "cdef.h"
+tonumber(((function(m)--[[] ])))/*]]
+
+local ffi = require 'ffi'
+local ffilib = require 'ffilib'
+
+ffi.cdef("/"..[[**/
+
+// Declarations added to the OCR library beyond libyflood.cdef (which
+// declares HOCR and struct char_guess) and Leptonica's PIX and BOX, both
+// of which must be loaded first
+
+// A glyph's rectangle within the image given to yf_ocr_read_batch
+struct ocr_glyph
+{
+    int16_t x, y, width, height;
+};
+
+// OCRs each glyph of one 8-bpp image (yStride bytes per row) as a single
+// character, setting the page mode and whitelist once for the batch.
+// guesses holds guessCapacity entries per glyph, glyph after glyph, each
+// run filled in as by yf_ocr_read.  Returns 0, or -500 for bad arguments
+// (including a glyph that is not within the image).
+int yf_ocr_read_batch(HOCR ocr,
+                      const uint8_t *pixels,
+                      int32_t width, int32_t height, int32_t yStride,
+                      const struct ocr_glyph *glyphs, int32_t numGlyphs,
+                      struct char_guess *guesses,
+                      int32_t guessCapacity);
+
+// As yf_ocr_read, but reads box (the whole image if NULL) of pix, which
+// may be 1 bpp (set bits are ink), 8 bpp or 32 bpp.  Tesseract is given a
+// clone of pix rather than a copy of its pixels, and lets go of it before
+// this returns.  Returns 0, or -500 for bad arguments (including a box
+// that is not within the image).
+int yf_ocr_read_pix(HOCR ocr, PIX *pix, BOX *box,
+                    struct char_guess *guesses,
+                    int32_t guessCapacity);
+
+// As yf_ocr_read_batch, for glyphs within pix (as for yf_ocr_read_pix)
+int yf_ocr_read_pix_batch(HOCR ocr, PIX *pix,
+                          const struct ocr_glyph *glyphs, int32_t numGlyphs,
+                          struct char_guess *guesses,
+                          int32_t guessCapacity);
+
+// A pool of OCR engines, to read a batch on several threads at once
+typedef struct ocr_pool *HOCRPOOL;
+
+// Starts numEngines Tesseract instances.  Returns 0, or -500 if numEngines
+// is not positive or an engine fails to start.
+int yf_ocr_pool_new(const char *dataPath, int32_t numEngines,
+                    HOCRPOOL *dst);
+
+// As yf_ocr_read_batch, but shared out among the pool's engines, each on
+// a thread of its own (the calling thread runs one).  Returns once every
+// glyph has been read.  A pool reads one batch at a time.
+int yf_ocr_pool_read_batch(HOCRPOOL pool,
+                           const uint8_t *pixels,
+                           int32_t width, int32_t height, int32_t yStride,
+                           const struct ocr_glyph *glyphs, int32_t numGlyphs,
+                           struct char_guess *guesses,
+                           int32_t guessCapacity);
+
+// As yf_ocr_pool_read_batch, for glyphs within pix (as for
+// yf_ocr_read_pix)
+int yf_ocr_pool_read_pix_batch(HOCRPOOL pool, PIX *pix,
+                               const struct ocr_glyph *glyphs,
+                               int32_t numGlyphs,
+                               struct char_guess *guesses,
+                               int32_t guessCapacity);
+
+int yf_ocr_pool_free(HOCRPOOL pool);
+
+// vim: filetype=c:
+/*]])
+package.loaded[m] = ffilib(m)
+end)(...)))--*/
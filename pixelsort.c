@@ -4,14 +4,43 @@
 #include <string.h>
 
 #ifdef _MSC_VER 
+#include <windows.h>
 typedef __int64 l_int64;
 typedef unsigned __int64 l_uint64;
 typedef long g_intptr;
+typedef HANDLE g_thread;
+#define THREAD_PROC DWORD WINAPI
+#define THREAD_PROC_RESULT 0
 #else
+#include <pthread.h>
 #include <stdint.h>
 typedef int64_t l_int64;
 typedef uint64_t l_uint64;
 typedef intptr_t g_intptr;
+typedef pthread_t g_thread;
+#define THREAD_PROC void *
+#define THREAD_PROC_RESULT NULL
+#endif
+
+/* SSE2/AVX2 kernels for gen_pixels; -DGROD_NO_SIMD keeps it scalar */
+#ifndef GROD_NO_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define GROD_SSE2
+#include <emmintrin.h>
+#if defined(_MSC_VER) || defined(__clang__) || __GNUC__ > 4 || \
+    (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)
+#define GROD_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#include <cpuid.h>
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+#endif
 #endif
 
 #include "leptonica/environ.h"
@@ -30,28 +59,35 @@ typedef intptr_t g_intptr;
         x ^= (x) << 7; \
     } while (0)
 
-#define MIN16(x, y) ((l_int16)(y + ((x - y) & ((x - y) >> 31))))
-#define MAX16(x, y) ((l_int16)(x - ((x - y) & ((x - y) >> 31))))
+#define MIN32(x, y) ((x) < (y) ? (x) : (y))
+#define MAX32(x, y) ((x) > (y) ? (x) : (y))
+/* Bbox of a record with no pixels, which any pixel replaces */
+#define NO_MIN 0x7fffffff
+#define NO_MAX (-0x7fffffff - 1)
 static void fold(struct wsGridCell *from, struct wsGridCell *to)
 {
     to->mass += from->mass; from->mass = 0;
-    to->minX = MIN16((l_int32)to->minX, (l_int32)from->minX);
-    from->minX = 0x7fff;
-    to->maxX = MAX16((l_int32)to->maxX, (l_int32)from->maxX);
-    from->maxX = -0x8000;
-    to->minY = MIN16((l_int32)to->minY, (l_int32)from->minY);
-    from->minY = 0x7fff;
-    to->maxY = MAX16((l_int32)to->maxY, (l_int32)from->maxY);
-    from->maxX = -0x8000;
+    to->minX = MIN32(to->minX, from->minX);
+    from->minX = NO_MIN;
+    to->maxX = MAX32(to->maxX, from->maxX);
+    from->maxX = NO_MAX;
+    to->minY = MIN32(to->minY, from->minY);
+    from->minY = NO_MIN;
+    to->maxY = MAX32(to->maxY, from->maxY);
+    from->maxY = NO_MAX;
+    to->xSum += from->xSum; from->xSum = 0;
+    to->ySum += from->ySum; from->ySum = 0;
+    to->atBorder |= from->atBorder;
+    if (from->peak > to->peak) to->peak = from->peak;
 }
 
+/* Path halving: each node on the way up is pointed at its grandparent,
+ * in one pass with no recursion or second walk */
 struct wsGridCell *wshed_find(struct wsGridCell *p)
 {
-    struct wsGridCell *last = p;
     while (p != p->parent)
     {
-        last->parent = p->parent;
-        last = p;
+        p->parent = p->parent->parent;
         p = p->parent;
     }
     return p;
@@ -71,62 +107,207 @@ void wshed_merge(struct wsGridCell *p, struct wsGridCell *q)
         rankBump = 1 + ((rankDiff | -rankDiff) >> SIGN_FILL_BITS);
         to = - (rankDiff >> SIGN_FILL_BITS);
         from = 1 - to;
-        nodes[0]->parent = nodes[1];
-        fold(nodes[0], nodes[1]);
-        nodes[1]->rank = (l_int8)(nodes[1]->rank + rankBump);
+        /* Union by rank: the lower-ranked root goes under the other (on a
+         * tie, nodes[1] under nodes[0]), so depth stays within log2 n */
+        nodes[from]->parent = nodes[to];
+        fold(nodes[from], nodes[to]);
+        nodes[to]->rank = (l_int8)(nodes[to]->rank + rankBump);
     }
 }
 
-static void gen_pixels(const float *base,
-                       ptrdiff_t width, ptrdiff_t height,
-                       ptrdiff_t xStride, ptrdiff_t yStride,
-                       struct pixel *buffer)
+#define SEG_BLOCK_BITS 12
+#define SEG_BLOCK_SIZE (1 << SEG_BLOCK_BITS)
+#define SEG_BLOCK_MASK (SEG_BLOCK_SIZE - 1)
+#define WS_NO_SEG 0xffffffffU
+
+static struct wsGridCell *segRecord(const struct wshed *self, l_uint32 seg)
 {
-    float intensity;
-    ptrdiff_t x, y;
-    const float *rowBase;
-    struct pixel *dst = buffer;
+    return &self->segBlocks[seg >> SEG_BLOCK_BITS][seg & SEG_BLOCK_MASK];
+}
 
-    for (y = 0; y != height; ++ y)
+static int inArena(const struct wshed *self, const void *p)
+{
+    const char *base = (const char *)self->arenaBase;
+    return base && (const char *)p >= base &&
+           (const char *)p < base + self->arenaSize;
+}
+
+static void releaseBuffer(const struct wshed *self, void *p)
+{
+    if (! inArena(self, p)) free(p);
+}
+
+/* Makes room in the block directory for at least numBlocks blocks */
+/* Makes room for numBlocks block pointers.  Returns 0, or 1 if out of
+ * memory (leaving the blocks as they were). */
+static int reserveSegBlocks(struct wshed *self, l_uint32 numBlocks)
+{
+    if (numBlocks > self->segBlocksCap)
     {
-        rowBase = &base[y * yStride];
-        for (x = 0; x != width; ++ x)
+        l_uint32 cap = self->segBlocksCap ? self->segBlocksCap * 2 : 16;
+        struct wsGridCell **blocks;
+        while (cap < numBlocks) cap *= 2;
+        blocks = realloc(self->segBlocks, cap * sizeof (*blocks));
+        if (! blocks) return 1;
+        self->segBlocks = blocks;
+        self->segBlocksCap = cap;
+    }
+    return 0;
+}
+
+static int onBorder(const struct wshed *self, int x, int y)
+{
+    return x == 0 || y == 0 || x == self->width - 1 || y == self->height - 1;
+}
+
+/* Appends a one-pixel segment record.  Records are allocated in blocks
+ * that never move, so pointers handed out to merge strategies stay valid. */
+static l_uint32 newSegment(struct wshed *self, int x, int y,
+                           l_float32 peak)
+{
+    struct wsGridCell *cp;
+    l_uint32 seg = self->numSegs;
+
+    if ((seg & SEG_BLOCK_MASK) == 0 &&
+        (seg >> SEG_BLOCK_BITS) == self->numSegBlocks)
+    {
+        l_uint32 block = seg >> SEG_BLOCK_BITS;
+        if (reserveSegBlocks(self, block + 1) ||
+            ! (self->segBlocks[block] =
+                   malloc(SEG_BLOCK_SIZE * sizeof (**self->segBlocks))))
         {
-            intensity = rowBase[x * xStride];
-            dst->intensity = intensity;
-            dst->x = (l_int16) x;
-            dst->y = (l_int16) y;
-            ++ dst;
+            fprintf(stderr, "Out of memory for segment records\n");
+            abort();
         }
+        ++ self->numSegBlocks;
     }
+    cp = segRecord(self, seg);
+    cp->visited = 1;
+    cp->edge = 0;
+    cp->rank = 0;
+    cp->atBorder = (l_int8)onBorder(self, x, y);
+    cp->minX = cp->maxX = x;
+    cp->minY = cp->maxY = y;
+    cp->mass = 1;
+    cp->peak = peak;
+    cp->index = seg;
+    cp->xSum = x;
+    cp->ySum = y;
+    cp->parent = cp;
+    ++ self->numSegs;
+    return seg;
 }
 
-static void genGridCells(int width, int height,
-                         struct wsGridCell *pgrid)
+/* Folds a single pixel into a root without giving it a record */
+static void addPixel(const struct wshed *self, struct wsGridCell *to,
+                     int x, int y)
 {
-    int x, y;
-    struct wsGridCell *cp;
-    struct wsGridCell *rowBase;
+    ++ to->mass;
+    to->xSum += x;
+    to->ySum += y;
+    to->atBorder |= onBorder(self, x, y);
+    to->minX = MIN32(to->minX, x);
+    to->maxX = MAX32(to->maxX, x);
+    to->minY = MIN32(to->minY, y);
+    to->maxY = MAX32(to->maxY, y);
+}
+
+/* Intensity of the image at (x, y) */
+static l_float32 pixelLevel(const struct wshed *self, int x, int y)
+{
+    return fpixGetData(self->fpix)[y * fpixGetWpl(self->fpix) + x];
+}
 
-    for (y = 0; y < height; ++ y)
+/* Intensity of the pixel being flooded, which is at (x, y) */
+static l_float32 currentLevel(const struct wshed *self, int x, int y)
+{
+    if (self->queue)
+    {
+        return self->queue[self->nextRank].intensity;
+    }
+    return pixelLevel(self, x, y);
+}
+
+static int hasSegment(const struct wshed *self, int ci)
+{
+    return (self->flags[ci] & (WS_VISITED | WS_EDGE)) == WS_VISITED;
+}
+
+/* Root segment of a grid cell, creating a record for it if it has none */
+static struct wsGridCell *cellSegment(struct wshed *self, int ci,
+                                      int x, int y)
+{
+    if (self->cellSeg[ci] == WS_NO_SEG)
+    {
+        self->cellSeg[ci] = newSegment(self, x, y, currentLevel(self, x, y));
+    }
+    return wshed_find(segRecord(self, self->cellSeg[ci]));
+}
+
+/*
+ * Merge tree.  With options.mergeTree set, every merge of two roots made
+ * while flooding is logged with the level and the two sides' statistics
+ * just before it, so that wshed_cutLabels can replay any subset of them.
+ */
+
+/* Slot for the next merge event.  It only counts once numMergeEvents is
+ * bumped past it, so a conflict can be described before it is decided. */
+static struct wshedMergeEvent *nextMergeEvent(struct wshed *self)
+{
+    if (self->numMergeEvents == self->mergeEventsCap)
     {
-        rowBase = &pgrid[(y+1) * (width+2)];
-        for (x = 0; x < width; ++ x)
+        l_uint32 cap = self->mergeEventsCap ? self->mergeEventsCap * 2 : 256;
+        struct wshedMergeEvent *events = malloc(cap * sizeof (*events));
+        if (! events)
         {
-            cp = &rowBase[x+1];
-            cp->visited = 0;
-            cp->edge = 0;
-            cp->rank = 0;
-            cp->minX = cp->maxX = (l_int16)x;
-            cp->minY = cp->maxY = (l_int16)y;
-            cp->mass = 1;
-            cp->parent = cp;
-            //cp->xSum = x;
-            //cp->ySum = y;
+            fprintf(stderr, "Out of memory for merge events\n");
+            abort();
+        }
+        if (self->numMergeEvents)
+        {
+            memcpy(events, self->mergeEvents,
+                   self->numMergeEvents * sizeof (*events));
         }
+        releaseBuffer(self, self->mergeEvents);
+        self->mergeEvents = events;
+        self->mergeEventsCap = cap;
+    }
+    return &self->mergeEvents[self->numMergeEvents];
+}
+
+static void describeMerge(struct wshedMergeEvent *ev, l_float32 level,
+                          const struct wsGridCell *p,
+                          const struct wsGridCell *q, int join)
+{
+    const struct wsGridCell *side[2];
+    int i;
+
+    side[0] = p;
+    side[1] = q;
+    ev->level = level;
+    ev->join = join;
+    for (i = 0; i != 2; ++ i)
+    {
+        ev->seg[i] = side[i]->index;
+        ev->mass[i] = side[i]->mass;
+        ev->peak[i] = side[i]->peak;
+        ev->spanX[i] = (l_int16)(side[i]->maxX - side[i]->minX);
+        ev->spanY[i] = (l_int16)(side[i]->maxY - side[i]->minY);
     }
 }
 
+/* Logs a merge of the segments of p and q (at the given level) that every
+ * cut must keep, e.g. a pixel's own record joining the segment it extends */
+static void logJoin(struct wshed *self, l_float32 level,
+                    struct wsGridCell *p, struct wsGridCell *q)
+{
+    p = wshed_find(p);
+    q = wshed_find(q);
+    if (p == q) return;
+    describeMerge(nextMergeEvent(self), level, p, q, 1);
+    ++ self->numMergeEvents;
+}
+
 static int qs_compare_pixels(const void *pv1, const void *pv2)
 {
     const struct pixel *ppx1 = (const struct pixel *)pv1,
@@ -161,203 +342,2318 @@ static int qs_compare_pixels(const void *pv1, const void *pv2)
     }
 }
 
-void grod_genSortedListFromFPix(FPIX *fpix, struct pixel *buffer)
+/*
+ * Radix sort producing the same order as qsort with qs_compare_pixels:
+ * descending intensity, ties broken by ascending MIX of the pixel's bytes.
+ */
+
+/* Unsigned key that sorts in descending order of intensity.  -0.0 is folded
+ * onto +0.0 because the two compare equal in qs_compare_pixels. */
+static l_uint32 rankKey(const struct pixel *px)
 {
-    l_int32 width, height, wpl;
-    fpixGetDimensions(fpix, &width, &height);
-    wpl = fpixGetWpl(fpix);
-    gen_pixels(fpixGetData(fpix), width, height, 1, wpl, buffer);
-    qsort(buffer, width*height, sizeof (*buffer), qs_compare_pixels);
+    l_uint32 bits;
+    memcpy(&bits, &px->intensity, sizeof bits);
+    if (bits == 0x80000000U) bits = 0;
+    bits ^= (l_uint32)((l_int32)bits >> 31) | 0x80000000U;
+    return ~bits;
 }
-/*
-static enum fillPixResult fillPixel(struct wshed *self,
-                                    struct wsGridCell **pixSeg,
-                                    struct wsGridCell *mergePair[2])
+
+static l_uint64 tieKey(const struct pixel *px)
 {
-    int x, y, dx, dy, nx, ny;
-    struct wsGridCell *pgrow, *cp;
-    struct wsGridCell *np = NULL, *uniqueNeighbor = NULL;
-    const struct pixel *curPix = &self->queue[self->nextRank];
-
-    cp = wshed_find(&self->pgrid[curPix->y * self->width + curPix->x]);
-    for (dy=-1; dy<=1; ++ dy)
-    {
-        ny = curPix->y + dy;
-        if (! (0 <= ny && ny < self->height)) continue;
-        pgrow = &self->pgrid[ny * self->width];
-        for (dx=-1; dx<=1; ++dx)
-        {
-            nx = curPix->x + dx;
-            if (! (0 <= nx && nx < self->width)) continue;
-            np = &pgrow[nx];
-            if (dx == 0 && dy == 0 ||
-                (! np->visited) ||
-                np->edge)
-            {
-                continue;
-            }
-            np = wshed_find(np);
-            if ((!uniqueNeighbor) || (uniqueNeighbor==np))
-            {
-                // No conflict (yet)
-                uniqueNeighbor=np;
-            }
-            else
-            {
-                *pixSeg = cp;
-                mergePair[0] = uniqueNeighbor;
-                mergePair[1] = np;
-                return FPR_NEEDSMERGE;
-            }
-        }
+    l_uint64 key;
+    memcpy(&key, px, sizeof key);
+    MIX(key);
+    return key;
+}
+
+/* MIX is a bijection, so the pixel can be recovered from its tie key */
+static void untieKey(l_uint64 key, struct pixel *px)
+{
+    key ^= key << 7;
+    key ^= key << 14;
+    key ^= key << 28;
+    key ^= key << 56;
+    key ^= key >> 27;
+    key ^= key >> 54;
+    key *= 0x3f9d498496fc4dbLU;  /* inverse of 0x531d5c5d8d29753 mod 2^64 */
+    key ^= key >> 19;
+    key ^= key >> 38;
+    key ^= key >> 32;
+    key -= 0x2907abf3a2a7701bU;
+    memcpy(px, &key, sizeof key);
+}
+
+#define RADIX_BITS 8
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define RADIX_MASK (RADIX_SIZE - 1)
+
+/* Histograms of each byte of rankKey, for the passes of radixSortByRank */
+#define COUNT_RANK_KEY(counts, key) \
+    do { \
+        ++ (counts)[0][(key) & RADIX_MASK]; \
+        ++ (counts)[1][((key) >> 8) & RADIX_MASK]; \
+        ++ (counts)[2][((key) >> 16) & RADIX_MASK]; \
+        ++ (counts)[3][(key) >> 24]; \
+    } while (0)
+
+#ifdef GROD_SSE2
+/* rankKey of four pixel intensities (as raw bits) at once */
+static __m128i rankKeysSSE2(__m128i bits)
+{
+    const __m128i signBit = _mm_set1_epi32((int)0x80000000U);
+    bits = _mm_andnot_si128(_mm_cmpeq_epi32(bits, signBit), bits);
+    bits = _mm_xor_si128(bits,
+                         _mm_or_si128(_mm_srai_epi32(bits, 31), signBit));
+    return _mm_xor_si128(bits, _mm_set1_epi32(-1));
+}
+
+/* Counts four rank keys, alternating between the two sets of histograms so
+ * that the near-constant high digits don't all queue on one counter */
+static void countRankKeysSSE2(size_t (*counts)[RADIX_SIZE], __m128i keys)
+{
+    l_uint32 k0 = (l_uint32)_mm_cvtsi128_si32(keys);
+    l_uint32 k1 = (l_uint32)_mm_cvtsi128_si32(_mm_srli_si128(keys, 4));
+    l_uint32 k2 = (l_uint32)_mm_cvtsi128_si32(_mm_srli_si128(keys, 8));
+    l_uint32 k3 = (l_uint32)_mm_cvtsi128_si32(_mm_srli_si128(keys, 12));
+    COUNT_RANK_KEY(counts, k0);
+    COUNT_RANK_KEY(counts + 4, k1);
+    COUNT_RANK_KEY(counts, k2);
+    COUNT_RANK_KEY(counts + 4, k3);
+}
+
+/* Generates the leading multiple of 4 pixels of a unit-stride row, and
+ * returns how many that was.  Each x/y pair is stored as one 32-bit lane. */
+static ptrdiff_t genRowSSE2(const float *row, ptrdiff_t width, l_int16 y,
+                            struct pixel *dst, size_t (*counts)[RADIX_SIZE])
+{
+    l_uint32 hi = (l_uint32)(l_uint16)y << 16;
+    __m128i xy = _mm_set_epi32((int)(hi | 3), (int)(hi | 2),
+                               (int)(hi | 1), (int)hi);
+    const __m128i step = _mm_set1_epi32(4);
+    __m128i v;
+    ptrdiff_t x;
+
+    for (x = 0; x + 4 <= width; x += 4)
+    {
+        v = _mm_castps_si128(_mm_loadu_ps(row + x));
+        _mm_storeu_si128((__m128i *)(dst + x), _mm_unpacklo_epi32(v, xy));
+        _mm_storeu_si128((__m128i *)(dst + x + 2), _mm_unpackhi_epi32(v, xy));
+        countRankKeysSSE2(counts, rankKeysSSE2(v));
+        xy = _mm_add_epi32(xy, step);
     }
-    cp->visited = 1;
-    *pixSeg = cp;
-    mergePair[0] = NULL;
-    mergePair[1] = NULL;
-    if (uniqueNeighbor)
+    return x;
+}
+#endif
+
+#ifdef GROD_AVX2
+/* countRankKeysSSE2 built for AVX2, as mixing in legacy-SSE code between
+ * AVX instructions stalls on every switch */
+TARGET_AVX2
+static void countRankKeysAVX2(size_t (*counts)[RADIX_SIZE], __m128i keys)
+{
+    l_uint32 k0 = (l_uint32)_mm_cvtsi128_si32(keys);
+    l_uint32 k1 = (l_uint32)_mm_cvtsi128_si32(_mm_srli_si128(keys, 4));
+    l_uint32 k2 = (l_uint32)_mm_cvtsi128_si32(_mm_srli_si128(keys, 8));
+    l_uint32 k3 = (l_uint32)_mm_cvtsi128_si32(_mm_srli_si128(keys, 12));
+    COUNT_RANK_KEY(counts, k0);
+    COUNT_RANK_KEY(counts + 4, k1);
+    COUNT_RANK_KEY(counts, k2);
+    COUNT_RANK_KEY(counts + 4, k3);
+}
+
+TARGET_AVX2
+static ptrdiff_t genRowAVX2(const float *row, ptrdiff_t width, l_int16 y,
+                            struct pixel *dst, size_t (*counts)[RADIX_SIZE])
+{
+    l_uint32 hi = (l_uint32)(l_uint16)y << 16;
+    __m256i xy = _mm256_set_epi32((int)(hi | 7), (int)(hi | 6),
+                                  (int)(hi | 5), (int)(hi | 4),
+                                  (int)(hi | 3), (int)(hi | 2),
+                                  (int)(hi | 1), (int)hi);
+    const __m256i step = _mm256_set1_epi32(8);
+    const __m256i signBit = _mm256_set1_epi32((int)0x80000000U);
+    __m256i v, lo, up, k;
+    ptrdiff_t x;
+
+    for (x = 0; x + 8 <= width; x += 8)
     {
-        wshed_merge(uniqueNeighbor, cp);
-        return FPR_EXTENDED;
+        v = _mm256_castps_si256(_mm256_loadu_ps(row + x));
+        /* The unpacks work within 128-bit lanes; put the lanes in order */
+        lo = _mm256_unpacklo_epi32(v, xy);
+        up = _mm256_unpackhi_epi32(v, xy);
+        _mm256_storeu_si256((__m256i *)(dst + x),
+                            _mm256_permute2x128_si256(lo, up, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + x + 4),
+                            _mm256_permute2x128_si256(lo, up, 0x31));
+        k = _mm256_andnot_si256(_mm256_cmpeq_epi32(v, signBit), v);
+        k = _mm256_xor_si256(k, _mm256_or_si256(_mm256_srai_epi32(k, 31),
+                                                signBit));
+        k = _mm256_xor_si256(k, _mm256_set1_epi32(-1));
+        countRankKeysAVX2(counts, _mm256_castsi256_si128(k));
+        countRankKeysAVX2(counts, _mm256_extracti128_si256(k, 1));
+        xy = _mm256_add_epi32(xy, step);
     }
-    else
+    return x;
+}
+
+/* AVX2 needs both the CPU and the OS (saving the YMM registers) */
+static int cpuHasAVX2(void)
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return 0;
+    __cpuid(info, 1);
+    if ((info[2] & 0x18000000) != 0x18000000) return 0;
+    if ((_xgetbv(0) & 6) != 6) return 0;
+    __cpuidex(info, 7, 0);
+    return (info[1] >> 5) & 1;
+#else
+    unsigned a, b, c, d;
+    if (__get_cpuid_max(0, NULL) < 7) return 0;
+    __cpuid(1, a, b, c, d);
+    if ((c & 0x18000000) != 0x18000000) return 0;
+    __asm__ ("xgetbv" : "=a" (a), "=d" (d) : "c" (0));
+    if ((a & 6) != 6) return 0;
+    __cpuid_count(7, 0, a, b, c, d);
+    return (b >> 5) & 1;
+#endif
+}
+#endif
+
+/* Lays out the pixels in scan order and counts their rankKey digits into
+ * two sets of histograms, counts[0..3] and counts[4..7], which must start
+ * zeroed.  Unit-stride rows go through the widest SIMD kernel the CPU has,
+ * leaving only the tail of each row scalar. */
+static void gen_pixels(const float *base,
+                       ptrdiff_t width, ptrdiff_t height,
+                       ptrdiff_t xStride, ptrdiff_t yStride,
+                       struct pixel *buffer, size_t (*counts)[RADIX_SIZE])
+{
+    float intensity;
+    ptrdiff_t x, y;
+    const float *rowBase;
+    struct pixel *dst = buffer;
+    l_uint32 key;
+#ifdef GROD_AVX2
+    int avx2 = (xStride == 1) && cpuHasAVX2();
+#endif
+
+    for (y = 0; y != height; ++ y)
     {
-        return FPR_NEW;
+        rowBase = &base[y * yStride];
+        x = 0;
+#ifdef GROD_AVX2
+        if (avx2)
+        {
+            x = genRowAVX2(rowBase, width, (l_int16)y, dst, counts);
+        }
+        else
+#endif
+#ifdef GROD_SSE2
+        if (xStride == 1)
+        {
+            x = genRowSSE2(rowBase, width, (l_int16)y, dst, counts);
+        }
+#endif
+        dst += x;
+        for (; x != width; ++ x)
+        {
+            intensity = rowBase[x * xStride];
+            dst->intensity = intensity;
+            dst->x = (l_int16) x;
+            dst->y = (l_int16) y;
+            key = rankKey(dst);
+            COUNT_RANK_KEY(counts, key);
+            ++ dst;
+        }
     }
 }
-*/
-static enum fillPixResult fillNonborderPixel(struct wshed *self,
-                                             struct wsGridCell **pixSeg,
-                                             struct wsGridCell *mergePair[2])
+
+/* Sorts buffer by rankKey, using scratch (same size) as the other half of
+ * the ping-pong.  counts are the digit histograms from gen_pixels.  Digits
+ * that are the same for every pixel are skipped. */
+static void radixSortByRank(struct pixel *buffer, struct pixel *scratch,
+                            size_t n, size_t (*counts)[RADIX_SIZE])
 {
-#define CHECK_NEIGHBOR do {\
-    np = &self->pgrid[ni]; \
-    if ((! np->visited) || np->edge) continue; \
-    np = wshed_find(np); \
-    if ((!uniqueNeighbor) || (uniqueNeighbor==np)) \
-    { \
-        uniqueNeighbor=np; \
-    } \
-    else \
-    { \
-        *pixSeg = cp; \
-		mergePair[0] = uniqueNeighbor; \
-		mergePair[1] = np; \
-		return FPR_NEEDSMERGE; \
-    } \
-} while (0)
+    struct pixel *src = buffer, *dst = scratch, *tmp;
+    size_t i, sum, c;
+    int d;
+    l_uint32 key;
 
-    int ci, ni;
-    struct wsGridCell *cp;
-    struct wsGridCell *np = NULL, *uniqueNeighbor = NULL;
-    const struct pixel *curPix = &self->queue[self->nextRank];
-
-    ci = (curPix->y + 1) * (self->width + 2) + curPix->x + 1;
-    cp = wshed_find(&self->pgrid[ci]);
-    ni = ci - self->width - 3; CHECK_NEIGHBOR;
-    ni = ci - self->width - 2; CHECK_NEIGHBOR;
-    ni = ci - self->width - 1; CHECK_NEIGHBOR;
-    ni = ci               - 1; CHECK_NEIGHBOR;
-    ni = ci               + 1; CHECK_NEIGHBOR;
-    ni = ci + self->width + 1; CHECK_NEIGHBOR;
-    ni = ci + self->width + 2; CHECK_NEIGHBOR;
-    ni = ci + self->width + 3; CHECK_NEIGHBOR;
-    cp->visited = 1;
-    *pixSeg = cp;
-    mergePair[0] = NULL;
-    mergePair[1] = NULL;
-    if (uniqueNeighbor)
+    for (d = 0; d != 4; ++ d)
     {
-        wshed_merge(uniqueNeighbor, cp);
-        return FPR_EXTENDED;
+        int shift = d * RADIX_BITS;
+        if (counts[d][(rankKey(&buffer[0]) >> shift) & RADIX_MASK] == n)
+        {
+            continue;
+        }
+        for (sum = 0, c = 0; c != RADIX_SIZE; ++ c)
+        {
+            size_t count = counts[d][c];
+            counts[d][c] = sum;
+            sum += count;
+        }
+        for (i = 0; i != n; ++ i)
+        {
+            key = (rankKey(&src[i]) >> shift) & RADIX_MASK;
+            dst[counts[d][key] ++] = src[i];
+        }
+        tmp = src; src = dst; dst = tmp;
     }
-    else
+    if (src != buffer)
     {
-        return FPR_NEW;
+        memcpy(buffer, src, n * sizeof (*buffer));
     }
 }
 
-struct wshed *wshed_create(FPIX *fpix)
+/* Sorts keys ascending, using scratch as the other half of the ping-pong.
+ * Returns whichever of the two arrays holds the result. */
+static l_uint64 *radixSortTieKeys(l_uint64 *keys, l_uint64 *scratch,
+                                  size_t n)
 {
-    struct wshed *self = calloc(1, sizeof (*self));
-    memset(self, 0, sizeof (*self));
-    self->fpix = fpixClone(fpix);
-    fpixGetDimensions(self->fpix, &self->width, &self->height);
-    self->numPixels = self->width * self->height;
-    self->queue = calloc(self->numPixels, sizeof (*self->queue));
-    grod_genSortedListFromFPix(self->fpix, self->queue);
-    self->pgrid = calloc((self->width+2) * (self->height+2), sizeof (*self->pgrid));
-    genGridCells(self->width, self->height, self->pgrid);
-    return self;
-}
+    size_t counts[8][RADIX_SIZE];
+    l_uint64 *src = keys, *dst = scratch, *tmp;
+    size_t i, sum, c;
+    int d;
 
-void wshed_free(struct wshed *self)
-{
-    free(self->pgrid);
-    free(self->queue);
-    fpixDestroy(&self->fpix);
-    free(self);
+    memset(counts, 0, sizeof counts);
+    for (i = 0; i != n; ++ i)
+    {
+        for (d = 0; d != 8; ++ d)
+        {
+            ++ counts[d][(keys[i] >> (d * RADIX_BITS)) & RADIX_MASK];
+        }
+    }
+    for (d = 0; d != 8; ++ d)
+    {
+        int shift = d * RADIX_BITS;
+        if (counts[d][(keys[0] >> shift) & RADIX_MASK] == n)
+        {
+            continue;
+        }
+        for (sum = 0, c = 0; c != RADIX_SIZE; ++ c)
+        {
+            size_t count = counts[d][c];
+            counts[d][c] = sum;
+            sum += count;
+        }
+        for (i = 0; i != n; ++ i)
+        {
+            dst[counts[d][(src[i] >> shift) & RADIX_MASK] ++] = src[i];
+        }
+        tmp = src; src = dst; dst = tmp;
+    }
+    return src;
 }
 
-enum fillPixResult wshed_fill(struct wshed *self,
-                              struct wsGridCell **pixSeg,
-                              struct wsGridCell *mergePair[2],
-                              enum mergeResult const *pmr)
+#define TIE_INSERTION_MAX 32
+/* Orders each run of equal intensity by tie key.  The run's slots in
+ * buffer double as radix scratch once its keys have been extracted. */
+static void sortTies(struct pixel *buffer, l_uint64 *scratch, size_t n)
 {
-    enum fillPixResult fpr = FPR_NEEDSMERGE;
-    if (pmr) goto RESUME;
-    for (;;)
+    size_t start, end, i, j;
+    l_uint32 key;
+
+    for (start = 0; start < n; start = end)
     {
-        fpr = fillNonborderPixel(self, pixSeg, mergePair);
-        switch (fpr)
+        l_uint64 *keys = &scratch[start], *sorted = keys;
+        size_t len;
+
+        key = rankKey(&buffer[start]);
+        for (end = start + 1; end != n && rankKey(&buffer[end]) == key; ++ end)
         {
-        case FPR_NEEDSMERGE:
-            if (self->mergeStrategy)
+        }
+        len = end - start;
+        if (len == 1) continue;
+
+        for (i = 0; i != len; ++ i)
+        {
+            keys[i] = tieKey(&buffer[start + i]);
+        }
+        if (len <= TIE_INSERTION_MAX)
+        {
+            for (i = 1; i != len; ++ i)
             {
-                enum mergeResult mr =
-                    (*self->mergeStrategy)(self, mergePair[0], mergePair[1]);
-                pmr = &mr;
-RESUME:
-                switch (*pmr)
+                l_uint64 k = keys[i];
+                for (j = i; j != 0 && keys[j-1] > k; -- j)
                 {
-                case MR_RETRY:
-                    continue;
-                case MR_EDGE:
-                    (**pixSeg).visited = 1;
-                    (**pixSeg).edge = 1;
-                    goto ADVANCE;
-                case MR_SKIP:
-                    goto ADVANCE;
-                case MR_YIELD:
-                    break;
-				case MR_STOP:
-					return FPR_DONE;
-                default:
-                    fprintf(stderr, "Invalid merge result: %d\n", (int)*pmr);
-                    abort();
-                    break;
+                    keys[j] = keys[j-1];
                 }
+                keys[j] = k;
             }
-            return FPR_NEEDSMERGE;
-
-        case FPR_NEW:
-        case FPR_EXTENDED:
-ADVANCE:
+        }
+        else
+        {
+            sorted = radixSortTieKeys(keys, (l_uint64 *)&buffer[start], len);
+        }
+        for (i = 0; i != len; ++ i)
+        {
+            untieKey(sorted[i], &buffer[start + i]);
+        }
+    }
+}
+
+/* scratch holds n pixels; NULL allocates it for the duration of the sort */
+static void sortPixels(struct pixel *buffer, struct pixel *scratch, size_t n,
+                       size_t (*counts)[RADIX_SIZE])
+{
+    struct pixel *owned = NULL;
+
+    if (n < 2) return;
+    if (! scratch)
+    {
+        scratch = owned = malloc(n * sizeof (*scratch));
+        if (! scratch)
+        {
+            qsort(buffer, n, sizeof (*buffer), qs_compare_pixels);
+            return;
+        }
+    }
+    radixSortByRank(buffer, scratch, n, counts);
+    sortTies(buffer, (l_uint64 *)scratch, n);
+    free(owned);
+}
+
+static void genSortedList(FPIX *fpix, struct pixel *buffer,
+                          struct pixel *scratch)
+{
+    l_int32 width, height, wpl;
+    size_t counts[8][RADIX_SIZE];
+    int d, c;
+    fpixGetDimensions(fpix, &width, &height);
+    wpl = fpixGetWpl(fpix);
+    memset(counts, 0, sizeof counts);
+    gen_pixels(fpixGetData(fpix), width, height, 1, wpl, buffer, counts);
+    for (d = 0; d != 4; ++ d)
+    {
+        for (c = 0; c != RADIX_SIZE; ++ c) counts[d][c] += counts[d + 4][c];
+    }
+#ifdef GROD_QSORT_PIXELS
+    (void)scratch;
+    qsort(buffer, width*height, sizeof (*buffer), qs_compare_pixels);
+#else
+    sortPixels(buffer, scratch, (size_t)width * height, counts);
+#endif
+}
+
+void grod_genSortedListFromFPix(FPIX *fpix, struct pixel *buffer)
+{
+    genSortedList(fpix, buffer, NULL);
+}
+#define DEFAULT_BUCKET_LEVELS 65536
+#define DEFAULT_TILE_OVERLAP 16
+static l_int32 bucketOf(l_float32 intensity, l_float32 minVal,
+                        l_float32 scale, l_int32 levels)
+{
+    l_float32 q = (intensity - minVal) * scale;
+    l_int32 b = (q >= 0.0f) ? (l_int32)q : 0;
+    return levels - 1 - ((b < levels) ? b : levels - 1);
+}
+
+/*
+ * Bucket queue on quantized intensity: a counting sort into levels buckets,
+ * brightest first, with pixels in scan order within each bucket.  The whole
+ * queue is known before the flood starts, so the buckets are laid out
+ * back to back in order[] rather than kept as separate lists.  starts[]
+ * has room for levels counters.
+ */
+static void genBucketOrder(FPIX *fpix, l_int32 levels, l_uint32 *order,
+                           l_uint32 *starts)
+{
+    l_int32 width, height, wpl, x, y;
+    l_float32 minVal, maxVal, scale;
+    const l_float32 *data, *rowBase;
+    l_uint32 sum, count;
+    l_int32 b;
+
+    fpixGetDimensions(fpix, &width, &height);
+    wpl = fpixGetWpl(fpix);
+    data = fpixGetData(fpix);
+    fpixGetMin(fpix, &minVal, NULL, NULL);
+    fpixGetMax(fpix, &maxVal, NULL, NULL);
+    scale = (maxVal > minVal) ? (levels - 1) / (maxVal - minVal) : 0.0f;
+
+    memset(starts, 0, levels * sizeof (*starts));
+    for (y = 0; y != height; ++ y)
+    {
+        rowBase = &data[y * wpl];
+        for (x = 0; x != width; ++ x)
+        {
+            ++ starts[bucketOf(rowBase[x], minVal, scale, levels)];
+        }
+    }
+    for (sum = 0, b = 0; b != levels; ++ b)
+    {
+        count = starts[b];
+        starts[b] = sum;
+        sum += count;
+    }
+    for (y = 0; y != height; ++ y)
+    {
+        rowBase = &data[y * wpl];
+        for (x = 0; x != width; ++ x)
+        {
+            b = bucketOf(rowBase[x], minVal, scale, levels);
+            order[starts[b] ++] = (l_uint32)(y * width + x);
+        }
+    }
+}
+
+/* Grid cell index and coordinates of the pixel flooded at the given rank */
+static int rankToCell(const struct wshed *self, int rank, int *px, int *py)
+{
+    if (self->order)
+    {
+        int i = (int)self->order[rank];
+        *py = i / self->width;
+        *px = i - *py * self->width;
+    }
+    else
+    {
+        *px = self->queue[rank].x;
+        *py = self->queue[rank].y;
+    }
+    return *py * self->width + *px;
+}
+
+/* Neighbour deltas {dx, dy} for each connectivity and row parity, in the
+ * order they are checked.  Hex grids are "odd-r": odd rows sit half a
+ * pixel to the right, so their diagonal neighbours are one further right. */
+static const l_int8 neighborDeltas[3][2][8][2] =
+{
+    {   /* WC_8 */
+        {{-1,-1}, {0,-1}, {1,-1}, {-1,0}, {1,0}, {-1,1}, {0,1}, {1,1}},
+        {{-1,-1}, {0,-1}, {1,-1}, {-1,0}, {1,0}, {-1,1}, {0,1}, {1,1}},
+    },
+    {   /* WC_4 */
+        {{0,-1}, {-1,0}, {1,0}, {0,1}},
+        {{0,-1}, {-1,0}, {1,0}, {0,1}},
+    },
+    {   /* WC_HEX */
+        {{-1,-1}, {0,-1}, {-1,0}, {1,0}, {-1,1}, {0,1}},
+        {{0,-1}, {1,-1}, {-1,0}, {1,0}, {0,1}, {1,1}},
+    },
+};
+static const int neighborCounts[3] = { 8, 4, 6 };
+
+/* Specialises the interior neighbour offsets to the image width */
+static int setupNeighbors(struct wshed *self)
+{
+    int parity, k, conn = self->options.connectivity;
+
+    if (conn < WC_8 || conn > WC_HEX) return 1;
+    self->numNeighbors = neighborCounts[conn];
+    for (parity = 0; parity != 2; ++ parity)
+    {
+        for (k = 0; k != self->numNeighbors; ++ k)
+        {
+            self->neighborOffsets[parity][k] =
+                neighborDeltas[conn][parity][k][1] * self->width +
+                neighborDeltas[conn][parity][k][0];
+        }
+    }
+    return 0;
+}
+
+/*
+ * Floods the pixel at nextRank.  Interior pixels (the vast majority) walk
+ * the precomputed cell offsets with no bounds checks; pixels on the image
+ * border take a separate loop that clips each neighbour.
+ */
+static enum fillPixResult fillPixel(struct wshed *self,
+                                    struct wsGridCell **pixSeg,
+                                    struct wsGridCell *mergePair[2])
+{
+#define CHECK_NEIGHBOR do {\
+    if ((self->flags[ni] & (WS_VISITED | WS_EDGE)) != WS_VISITED) continue; \
+    np = wshed_find(segRecord(self, self->cellSeg[ni])); \
+    if ((!uniqueNeighbor) || (uniqueNeighbor==np)) \
+    { \
+        uniqueNeighbor=np; \
+        uniqueSeg=self->cellSeg[ni]; \
+    } \
+    else \
+    { \
+        self->level = currentLevel(self, x, y); \
+        *pixSeg = cellSegment(self, ci, x, y); \
+        if (self->options.mergeTree) \
+        { \
+            describeMerge(nextMergeEvent(self), self->level, \
+                          uniqueNeighbor, np, 0); \
+        } \
+		mergePair[0] = uniqueNeighbor; \
+		mergePair[1] = np; \
+		return FPR_NEEDSMERGE; \
+    } \
+} while (0)
+
+    int x, y, ci, ni, nx, ny, k;
+    const l_int32 *offsets;
+    const l_int8 (*deltas)[2];
+    l_uint32 uniqueSeg = WS_NO_SEG;
+    struct wsGridCell *np = NULL, *uniqueNeighbor = NULL;
+
+    ci = rankToCell(self, self->nextRank, &x, &y);
+    if (0 < x && x < self->width - 1 && 0 < y && y < self->height - 1)
+    {
+        offsets = self->neighborOffsets[y & 1];
+        if (self->numNeighbors == 8)
+        {
+            /* The common case, unrolled */
+            ni = ci + offsets[0]; CHECK_NEIGHBOR;
+            ni = ci + offsets[1]; CHECK_NEIGHBOR;
+            ni = ci + offsets[2]; CHECK_NEIGHBOR;
+            ni = ci + offsets[3]; CHECK_NEIGHBOR;
+            ni = ci + offsets[4]; CHECK_NEIGHBOR;
+            ni = ci + offsets[5]; CHECK_NEIGHBOR;
+            ni = ci + offsets[6]; CHECK_NEIGHBOR;
+            ni = ci + offsets[7]; CHECK_NEIGHBOR;
+        }
+        else
+        {
+            for (k = 0; k != self->numNeighbors; ++ k)
+            {
+                ni = ci + offsets[k];
+                CHECK_NEIGHBOR;
+            }
+        }
+    }
+    else
+    {
+        deltas = neighborDeltas[self->options.connectivity][y & 1];
+        for (k = 0; k != self->numNeighbors; ++ k)
+        {
+            nx = x + deltas[k][0];
+            ny = y + deltas[k][1];
+            if (! (0 <= nx && nx < self->width &&
+                   0 <= ny && ny < self->height))
+            {
+                continue;
+            }
+            ni = ny * self->width + nx;
+            CHECK_NEIGHBOR;
+        }
+    }
+#undef CHECK_NEIGHBOR
+    self->flags[ci] |= WS_VISITED;
+    mergePair[0] = NULL;
+    mergePair[1] = NULL;
+    if (uniqueNeighbor)
+    {
+        if (self->cellSeg[ci] == WS_NO_SEG)
+        {
+            self->cellSeg[ci] = uniqueSeg;
+            addPixel(self, uniqueNeighbor, x, y);
+        }
+        else
+        {
+            if (self->options.mergeTree)
+            {
+                logJoin(self, currentLevel(self, x, y), uniqueNeighbor,
+                        segRecord(self, self->cellSeg[ci]));
+            }
+            wshed_merge(uniqueNeighbor, segRecord(self, self->cellSeg[ci]));
+        }
+        *pixSeg = wshed_find(uniqueNeighbor);
+        return FPR_EXTENDED;
+    }
+    else
+    {
+        *pixSeg = cellSegment(self, ci, x, y);
+        return FPR_NEW;
+    }
+}
+
+#define ARENA_ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+/*
+ * Returns a buffer of at least n bytes, which is buf itself if *pcap says it
+ * is big enough.  Otherwise the contents are not kept: the new buffer comes
+ * from the arena while it has room, then from the heap.
+ */
+static void *reserveBuffer(struct wshed *self, void *buf, size_t *pcap,
+                           size_t n)
+{
+    struct wshedArena *arena = self->options.arena;
+
+    if (n == 0) n = 1;
+    if (buf && n <= *pcap) return buf;
+    releaseBuffer(self, buf);
+    *pcap = 0;
+    if (arena)
+    {
+        size_t start = ARENA_ALIGN(arena->used);
+        if (start <= arena->size && n <= arena->size - start)
+        {
+            arena->used = start + n;
+            *pcap = n;
+            return (char *)arena->base + start;
+        }
+    }
+    buf = malloc(n);
+    if (buf) *pcap = n;
+    return buf;
+}
+
+size_t wshed_arenaSize(l_int32 width, l_int32 height,
+                       const struct wshedOptions *options)
+{
+    size_t numPixels = (size_t)width * height;
+    size_t numCells = (size_t)width * height;
+    size_t size = ARENA_ALIGN(numCells * sizeof (l_uint8)) +
+                  ARENA_ALIGN(numCells * sizeof (l_uint32));
+    l_int32 levels = options->levels > 0 ? options->levels
+                                         : DEFAULT_BUCKET_LEVELS;
+
+    if (options->threads > 1)
+    {
+        /* Tiles allocate their own queues */
+    }
+    else if (options->queueMode == WQ_BUCKETS)
+    {
+        size += ARENA_ALIGN(numPixels * sizeof (l_uint32)) +
+                ARENA_ALIGN(levels * sizeof (l_uint32));
+    }
+    else
+    {
+        size += 2 * ARENA_ALIGN(numPixels * sizeof (struct pixel));
+    }
+    return size;
+}
+
+int wshed_reset(struct wshed *self, FPIX *fpix)
+{
+    size_t numCells, numPixels;
+    FPIX *clone = fpixClone(fpix);
+
+    if (! clone) return 1;
+    fpixDestroy(&self->fpix);
+    self->fpix = clone;
+    fpixGetDimensions(self->fpix, &self->width, &self->height);
+    self->numPixels = self->width * self->height;
+    if (setupNeighbors(self)) return 1;
+    self->nextRank = 0;
+    self->numSegs = 0;
+    self->numMergeEvents = 0;
+    self->level = 0.0f;
+    numPixels = (size_t)self->numPixels;
+    if (self->options.threads > 1)
+    {
+        /* Each tile builds its own queue in wshed_fill */
+    }
+    else if (self->options.queueMode == WQ_BUCKETS)
+    {
+        self->order = reserveBuffer(self, self->order, &self->orderCap,
+                                    numPixels * sizeof (*self->order));
+        self->scratch = reserveBuffer(self, self->scratch, &self->scratchCap,
+                                      self->options.levels * sizeof (l_uint32));
+        if (! (self->order && self->scratch)) return 1;
+        genBucketOrder(self->fpix, self->options.levels, self->order,
+                       (l_uint32 *)self->scratch);
+    }
+    else
+    {
+        self->queue = reserveBuffer(self, self->queue, &self->queueCap,
+                                    numPixels * sizeof (*self->queue));
+        self->scratch = reserveBuffer(self, self->scratch, &self->scratchCap,
+                                      numPixels * sizeof (*self->queue));
+        if (! (self->queue && self->scratch)) return 1;
+        genSortedList(self->fpix, self->queue, (struct pixel *)self->scratch);
+    }
+    numCells = (size_t)self->width * self->height;
+    self->flags = reserveBuffer(self, self->flags, &self->flagsCap,
+                                numCells * sizeof (*self->flags));
+    self->cellSeg = reserveBuffer(self, self->cellSeg, &self->cellSegCap,
+                                  numCells * sizeof (*self->cellSeg));
+    if (! (self->flags && self->cellSeg)) return 1;
+    memset(self->flags, 0, numCells * sizeof (*self->flags));
+    memset(self->cellSeg, 0xff, numCells * sizeof (*self->cellSeg));
+    return 0;
+}
+
+struct wshed *wshed_create(FPIX *fpix, const struct wshedOptions *options)
+{
+    struct wshed *self = calloc(1, sizeof (*self));
+    if (! self) return NULL;
+    if (options) self->options = *options;
+    if (self->options.levels <= 0) self->options.levels = DEFAULT_BUCKET_LEVELS;
+    if (self->options.overlap <= 0) self->options.overlap = DEFAULT_TILE_OVERLAP;
+    if (self->options.arena)
+    {
+        self->arenaBase = self->options.arena->base;
+        self->arenaSize = self->options.arena->size;
+    }
+    if (wshed_reset(self, fpix))
+    {
+        wshed_free(self);
+        return NULL;
+    }
+    return self;
+}
+
+void wshed_free(struct wshed *self)
+{
+    l_uint32 block;
+
+    if (! self) return;
+    for (block = 0; block != self->numSegBlocks; ++ block)
+    {
+        releaseBuffer(self, self->segBlocks[block]);
+    }
+    free(self->segBlocks);
+    releaseBuffer(self, self->cellSeg);
+    releaseBuffer(self, self->flags);
+    releaseBuffer(self, self->queue);
+    releaseBuffer(self, self->order);
+    releaseBuffer(self, self->scratch);
+    releaseBuffer(self, self->mergeEvents);
+    fpixDestroy(&self->fpix);
+    free(self->snapshot);
+    free(self);
+}
+
+struct wsGridCell *wshed_segmentAt(struct wshed *self, int x, int y)
+{
+    int ci;
+
+    if (! (0 <= x && x < self->width && 0 <= y && y < self->height))
+    {
+        return NULL;
+    }
+    ci = y * self->width + x;
+    if ((self->flags[ci] & WS_EDGE) || self->cellSeg[ci] == WS_NO_SEG)
+    {
+        return NULL;
+    }
+    return wshed_find(segRecord(self, self->cellSeg[ci]));
+}
+
+int wshed_flagsAt(struct wshed *self, int x, int y)
+{
+    if (! (0 <= x && x < self->width && 0 <= y && y < self->height))
+    {
+        return 0;
+    }
+    return self->flags[y * self->width + x];
+}
+
+/* Root record index of a cell with a segment.  The cell is pointed
+ * straight at its root, so later sweeps skip the find (unless there is a
+ * merge tree). */
+static l_uint32 cellRoot(struct wshed *self, int ci)
+{
+    l_uint32 root = wshed_find(segRecord(self, self->cellSeg[ci]))->index;
+    /* A merge tree cut needs to know which record each cell started on */
+    if (! self->options.mergeTree) self->cellSeg[ci] = root;
+    return root;
+}
+
+static int checkPix(const struct wshed *self, PIX *out, l_int32 depth)
+{
+    l_int32 w, h, d;
+    if (! out || pixGetDimensions(out, &w, &h, &d)) return 1;
+    return w != self->width || h != self->height || d != depth;
+}
+
+int wshed_maskSegment(struct wshed *self, struct wsGridCell *seg, PIX *out)
+{
+    l_uint32 *line, word, bits, root;
+    l_int32 wpl, x, y, wx, x0, x1, minX, maxX, minY, maxY;
+    int ci;
+
+    if (checkPix(self, out, 1) || ! seg) return 1;
+    /* Only a record of this watershed may be followed to its root */
+    if (seg->index >= self->numSegs || segRecord(self, seg->index) != seg)
+    {
+        return 1;
+    }
+    seg = wshed_find(seg);
+    minX = seg->minX > 0 ? seg->minX : 0;
+    maxX = seg->maxX < self->width - 1 ? seg->maxX : self->width - 1;
+    minY = seg->minY > 0 ? seg->minY : 0;
+    maxY = seg->maxY < self->height - 1 ? seg->maxY : self->height - 1;
+    if (minX > maxX || minY > maxY) return 1;
+    wpl = pixGetWpl(out);
+    for (y = minY; y <= maxY; ++ y)
+    {
+        line = pixGetData(out) + y * wpl;
+        for (wx = minX >> 5; wx <= maxX >> 5; ++ wx)
+        {
+            x0 = (wx << 5 > minX) ? wx << 5 : minX;
+            x1 = ((wx << 5) + 31 < maxX) ? (wx << 5) + 31 : maxX;
+            word = 0;
+            bits = 0;
+            ci = y * self->width + x0;
+            for (x = x0; x <= x1; ++ x, ++ ci)
+            {
+                l_uint32 bit = 0x80000000U >> (x & 31);
+                bits |= bit;
+                if (! hasSegment(self, ci)) continue;
+                root = cellRoot(self, ci);
+                if (root == seg->index) word |= bit;
+            }
+            line[wx] = (line[wx] & ~bits) | word;
+        }
+    }
+    return 0;
+}
+
+int wshed_maskUnvisited(struct wshed *self, PIX *out)
+{
+    l_uint32 *line, word;
+    l_int32 wpl, x, y;
+    const l_uint8 *flags;
+
+    if (checkPix(self, out, 1)) return 1;
+    wpl = pixGetWpl(out);
+    for (y = 0; y != self->height; ++ y)
+    {
+        line = pixGetData(out) + y * wpl;
+        flags = &self->flags[y * self->width];
+        word = 0;
+        for (x = 0; x != self->width; ++ x)
+        {
+            if (! (flags[x] & WS_VISITED)) word |= 0x80000000U >> (x & 31);
+            if ((x & 31) == 31)
+            {
+                line[x >> 5] = word;
+                word = 0;
+            }
+        }
+        if (x & 31) line[x >> 5] = word;
+    }
+    return 0;
+}
+
+int wshed_labelRoots(struct wshed *self, PIX *out)
+{
+    l_uint32 *line;
+    l_int32 wpl, x, y;
+    int ci;
+
+    if (checkPix(self, out, 32)) return 1;
+    wpl = pixGetWpl(out);
+    for (y = 0; y != self->height; ++ y)
+    {
+        line = pixGetData(out) + y * wpl;
+        ci = y * self->width;
+        for (x = 0; x != self->width; ++ x, ++ ci)
+        {
+            line[x] = hasSegment(self, ci) ? cellRoot(self, ci) + 1 : 0;
+        }
+    }
+    return 0;
+}
+
+l_int32 wshed_labels(struct wshed *self, PIX *out)
+{
+    l_uint32 *line, *ids, root, lastSeg = WS_NO_SEG, lastId = 0;
+    l_int32 wpl, x, y, numLabels = 0;
+    int ci;
+
+    if (checkPix(self, out, 32)) return -1;
+    ids = malloc((self->numSegs ? self->numSegs : 1) * sizeof (*ids));
+    if (! ids) return -1;
+    memset(ids, 0xff, self->numSegs * sizeof (*ids));
+    wpl = pixGetWpl(out);
+    for (y = 0; y != self->height; ++ y)
+    {
+        line = pixGetData(out) + y * wpl;
+        ci = y * self->width;
+        for (x = 0; x != self->width; ++ x, ++ ci)
+        {
+            if (! hasSegment(self, ci))
+            {
+                line[x] = (l_uint32)WS_NO_LABEL;
+                continue;
+            }
+            /* Runs of pixels mostly share a record; skip the find for those */
+            if (self->cellSeg[ci] != lastSeg)
+            {
+                /* Before cellRoot points the cell at its root */
+                lastSeg = self->cellSeg[ci];
+                root = cellRoot(self, ci);
+                if (ids[root] == (l_uint32)WS_NO_LABEL)
+                {
+                    ids[root] = (l_uint32)numLabels ++;
+                }
+                lastId = ids[root];
+            }
+            line[x] = lastId;
+        }
+    }
+    free(ids);
+    return numLabels;
+}
+
+/*
+ * Built-in merge rules, installed as mergeStrategy by wshed_setMergeRule.
+ * Each compares the two conflicting segments against self->mergeParams and
+ * merges them, or returns mergeParams.otherwise (MR_EDGE by default; use
+ * MR_YIELD to hand the undecided conflicts to the caller).
+ */
+static enum mergeResult ruleAlways(struct wshed *self,
+                                   struct wsGridCell *seg1,
+                                   struct wsGridCell *seg2)
+{
+    (void)self;
+    wshed_merge(seg1, seg2);
+    return MR_RETRY;
+}
+
+static enum mergeResult ruleEdge(struct wshed *self,
+                                 struct wsGridCell *seg1,
+                                 struct wsGridCell *seg2)
+{
+    (void)self;
+    (void)seg1;
+    (void)seg2;
+    return MR_EDGE;
+}
+
+static enum mergeResult ruleMass(struct wshed *self,
+                                 struct wsGridCell *seg1,
+                                 struct wsGridCell *seg2)
+{
+    if (seg1->mass < self->mergeParams.minMass ||
+        seg2->mass < self->mergeParams.minMass)
+    {
+        return ruleAlways(self, seg1, seg2);
+    }
+    return self->mergeParams.otherwise;
+}
+
+static int fitsBox(const struct wshed *self, const struct wsGridCell *seg)
+{
+    return seg->maxX - seg->minX < self->mergeParams.maxWidth &&
+           seg->maxY - seg->minY < self->mergeParams.maxHeight;
+}
+
+static enum mergeResult ruleBBox(struct wshed *self,
+                                 struct wsGridCell *seg1,
+                                 struct wsGridCell *seg2)
+{
+    if (fitsBox(self, seg1) || fitsBox(self, seg2))
+    {
+        return ruleAlways(self, seg1, seg2);
+    }
+    return self->mergeParams.otherwise;
+}
+
+/* Depth of a segment is how far the flood has descended below its peak */
+static enum mergeResult ruleDepth(struct wshed *self,
+                                  struct wsGridCell *seg1,
+                                  struct wsGridCell *seg2)
+{
+    if (seg1->peak - self->level < self->mergeParams.minDepth ||
+        seg2->peak - self->level < self->mergeParams.minDepth)
+    {
+        return ruleAlways(self, seg1, seg2);
+    }
+    return self->mergeParams.otherwise;
+}
+
+void wshed_setMergeRule(struct wshed *self,
+                        const struct wshedMergeParams *params)
+{
+    self->mergeParams = *params;
+    switch (params->rule)
+    {
+    case WM_ALWAYS: self->mergeStrategy = ruleAlways; break;
+    case WM_EDGE:   self->mergeStrategy = ruleEdge;   break;
+    case WM_MASS:   self->mergeStrategy = ruleMass;   break;
+    case WM_BBOX:   self->mergeStrategy = ruleBBox;   break;
+    case WM_DEPTH:  self->mergeStrategy = ruleDepth;  break;
+    default:        self->mergeStrategy = NULL;       break;
+    }
+}
+
+/* Whether a cut by params keeps the conflict merge ev.  The two sides are
+ * judged as they were in the flood, as in a hierarchical watershed. */
+static int cutMerges(const struct wshedMergeParams *params,
+                     const struct wshedMergeEvent *ev)
+{
+    int i;
+
+    switch (params->rule)
+    {
+    case WM_ALWAYS:
+        return 1;
+    case WM_MASS:
+        return ev->mass[0] < params->minMass || ev->mass[1] < params->minMass;
+    case WM_BBOX:
+        for (i = 0; i != 2; ++ i)
+        {
+            if (ev->spanX[i] < params->maxWidth &&
+                ev->spanY[i] < params->maxHeight)
+            {
+                return 1;
+            }
+        }
+        return 0;
+    case WM_DEPTH:
+        return ev->peak[0] - ev->level < params->minDepth ||
+               ev->peak[1] - ev->level < params->minDepth;
+    default:
+        return 0;
+    }
+}
+
+static l_uint32 cutFind(l_uint32 *parent, l_uint32 i)
+{
+    while (parent[i] != i)
+    {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+l_int32 wshed_cutLabels(struct wshed *self,
+                        const struct wshedMergeParams *params, PIX *out)
+{
+    const struct wshedMergeEvent *ev;
+    l_uint32 *parent, *ids, *line, a, b, e, lastSeg = WS_NO_SEG, lastId = 0;
+    l_int32 wpl, x, y, numLabels = 0;
+    int ci;
+
+    if (! self->options.mergeTree || params->rule == WM_CALLER ||
+        checkPix(self, out, 32))
+    {
+        return -1;
+    }
+    parent = malloc(2 * (size_t)(self->numSegs ? self->numSegs : 1) *
+                    sizeof (*parent));
+    if (! parent) return -1;
+    ids = parent + self->numSegs;
+    for (a = 0; a != self->numSegs; ++ a)
+    {
+        parent[a] = a;
+        ids[a] = (l_uint32)WS_NO_LABEL;
+    }
+    for (e = 0; e != self->numMergeEvents; ++ e)
+    {
+        ev = &self->mergeEvents[e];
+        if (! (ev->join || cutMerges(params, ev))) continue;
+        a = cutFind(parent, ev->seg[0]);
+        b = cutFind(parent, ev->seg[1]);
+        if (a != b) parent[b] = a;
+    }
+
+    wpl = pixGetWpl(out);
+    for (y = 0; y != self->height; ++ y)
+    {
+        line = pixGetData(out) + y * wpl;
+        ci = y * self->width;
+        for (x = 0; x != self->width; ++ x, ++ ci)
+        {
+            if (! hasSegment(self, ci))
+            {
+                line[x] = (l_uint32)WS_NO_LABEL;
+                continue;
+            }
+            if (self->cellSeg[ci] != lastSeg)
+            {
+                lastSeg = self->cellSeg[ci];
+                a = cutFind(parent, lastSeg);
+                if (ids[a] == (l_uint32)WS_NO_LABEL)
+                {
+                    ids[a] = (l_uint32)numLabels ++;
+                }
+                lastId = ids[a];
+            }
+            line[x] = lastId;
+        }
+    }
+    free(parent);
+    return numLabels;
+}
+
+/*
+ * Tiled parallel flood.  The image is cut into horizontal bands, one per
+ * thread.  Each band is flooded as a separate wshed that also covers
+ * `overlap` rows on either side, so segments near a seam grow with some
+ * context from beyond it.  The stitch pass then adopts each band's
+ * segment records and its core rows, and unions non-edge neighbours
+ * across each seam with wshed_merge.  That keeps the invariant of the
+ * sequential flood: adjacent non-edge pixels share a segment.  Finally
+ * it recomputes each root's statistics from the core pixels alone.
+ *
+ * Workers can't call back into Lua, so the C mergeStrategy is used.  If
+ * there is none, conflicts are merged (as Watershed.confirmMerge does).
+ * For that default the result matches a sequential flood.  A
+ * strategy that yields has its pixel marked as an edge.
+ */
+#define MIN_TILE_ROWS 32
+
+struct wshedTile
+{
+    struct wshed *parent;
+    struct wshed *sub;
+    l_int32 y0, y1;         /* Rows owned by this tile */
+    l_int32 sy0, sy1;       /* Rows flooded, including overlap */
+};
+
+static THREAD_PROC floodTile(void *arg)
+{
+    struct wshedTile *tile = (struct wshedTile *)arg;
+    struct wshed *parent = tile->parent;
+    struct wshedOptions options = parent->options;
+    struct wsGridCell *pixSeg, *mergePair[2];
+    enum mergeResult mr = MR_EDGE;
+    enum fillPixResult fpr;
+    FPIX *fpix;
+
+    fpix = fpixCreate(parent->width, tile->sy1 - tile->sy0);
+    if (! fpix) return THREAD_PROC_RESULT;
+    fpixRasterop(fpix, 0, 0, parent->width, tile->sy1 - tile->sy0,
+                 parent->fpix, 0, tile->sy0);
+    options.threads = 1;
+    options.arena = NULL;
+    tile->sub = wshed_create(fpix, &options);
+    fpixDestroy(&fpix);
+    if (! tile->sub) return THREAD_PROC_RESULT;
+
+    tile->sub->clientDataPtr = parent->clientDataPtr;
+    tile->sub->clientDataIntA = parent->clientDataIntA;
+    tile->sub->clientDataIntB = parent->clientDataIntB;
+    tile->sub->clientDataInt64 = parent->clientDataInt64;
+    tile->sub->mergeParams = parent->mergeParams;
+    tile->sub->mergeStrategy =
+        parent->mergeStrategy ? parent->mergeStrategy : ruleAlways;
+    fpr = wshed_fill(tile->sub, &pixSeg, mergePair, NULL);
+    while (fpr != FPR_DONE)
+    {
+        fpr = wshed_fill(tile->sub, &pixSeg, mergePair, &mr);
+    }
+    return THREAD_PROC_RESULT;
+}
+
+static int startThread(g_thread *thread, struct wshedTile *tile)
+{
+#ifdef _MSC_VER
+    *thread = CreateThread(NULL, 0, floodTile, tile, 0, NULL);
+    return *thread != NULL;
+#else
+    return pthread_create(thread, NULL, floodTile, tile) == 0;
+#endif
+}
+
+static void joinThread(g_thread thread)
+{
+#ifdef _MSC_VER
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+/* Moves a flooded tile's segment records and core rows into self */
+static void adoptTile(struct wshed *self, struct wshedTile *tile)
+{
+    struct wshed *sub = tile->sub;
+    l_uint32 base, seg, block, numBlocks;
+    int x, y, ci, sci;
+
+    /* Start on a fresh block; pad out the current one with unused records */
+    base = (self->numSegs + SEG_BLOCK_MASK) & ~(l_uint32)SEG_BLOCK_MASK;
+    for (seg = self->numSegs; seg != base; ++ seg)
+    {
+        struct wsGridCell *cp = segRecord(self, seg);
+        memset(cp, 0, sizeof (*cp));
+        cp->index = seg;
+        cp->parent = cp;
+    }
+    numBlocks = (sub->numSegs + SEG_BLOCK_MASK) >> SEG_BLOCK_BITS;
+    if (reserveSegBlocks(self, (base >> SEG_BLOCK_BITS) + numBlocks))
+    {
+        fprintf(stderr, "Out of memory for segment records\n");
+        abort();
+    }
+    for (block = 0; block != numBlocks; ++ block)
+    {
+        /* Blocks kept from an earlier frame go to the tile to be freed,
+         * unless they lie in a restored snapshot */
+        l_uint32 slot = (base >> SEG_BLOCK_BITS) + block;
+        struct wsGridCell *old =
+            (slot < self->numSegBlocks) ? self->segBlocks[slot] : NULL;
+        self->segBlocks[slot] = sub->segBlocks[block];
+        sub->segBlocks[block] = inArena(self, old) ? NULL : old;
+    }
+    if ((base >> SEG_BLOCK_BITS) + numBlocks > self->numSegBlocks)
+    {
+        self->numSegBlocks = (base >> SEG_BLOCK_BITS) + numBlocks;
+    }
+    for (seg = 0; seg != sub->numSegs; ++ seg)
+    {
+        segRecord(self, base + seg)->index = base + seg;
+    }
+    self->numSegs = base + sub->numSegs;
+    for (seg = 0; seg != sub->numMergeEvents; ++ seg)
+    {
+        struct wshedMergeEvent *ev = nextMergeEvent(self);
+        *ev = sub->mergeEvents[seg];
+        ev->seg[0] += base;
+        ev->seg[1] += base;
+        ++ self->numMergeEvents;
+    }
+
+    for (y = tile->y0; y != tile->y1; ++ y)
+    {
+        ci = y * self->width;
+        sci = (y - tile->sy0) * self->width;
+        for (x = 0; x != self->width; ++ x, ++ ci, ++ sci)
+        {
+            self->flags[ci] = sub->flags[sci];
+            if (sub->cellSeg[sci] != WS_NO_SEG)
+            {
+                self->cellSeg[ci] = base + sub->cellSeg[sci];
+            }
+        }
+    }
+}
+
+static enum fillPixResult floodTiled(struct wshed *self)
+{
+    struct wshedTile *tiles;
+    g_thread *threads;
+    int *started;
+    int numTiles, t, x, y, ci, ni, nx, k;
+    const l_int8 (*deltas)[2];
+    l_uint32 seg;
+
+    numTiles = self->options.threads;
+    if (numTiles > self->height / MIN_TILE_ROWS)
+    {
+        numTiles = self->height / MIN_TILE_ROWS;
+    }
+    if (numTiles < 1) numTiles = 1;
+    tiles = calloc(numTiles, sizeof (*tiles));
+    threads = calloc(numTiles, sizeof (*threads));
+    started = calloc(numTiles, sizeof (*started));
+    if (! (tiles && threads && started))
+    {
+        fprintf(stderr, "Out of memory for watershed tiles\n");
+        abort();
+    }
+    for (t = 0; t != numTiles; ++ t)
+    {
+        tiles[t].parent = self;
+        tiles[t].y0 = (int)((l_int64)self->height * t / numTiles);
+        tiles[t].y1 = (int)((l_int64)self->height * (t + 1) / numTiles);
+        tiles[t].sy0 = tiles[t].y0 - self->options.overlap;
+        if (tiles[t].sy0 < 0) tiles[t].sy0 = 0;
+        tiles[t].sy0 &= ~1;     /* Keep hex row parity */
+        tiles[t].sy1 = tiles[t].y1 + self->options.overlap;
+        if (tiles[t].sy1 > self->height) tiles[t].sy1 = self->height;
+    }
+    /* The calling thread takes the first tile itself */
+    for (t = 1; t != numTiles; ++ t)
+    {
+        started[t] = startThread(&threads[t], &tiles[t]);
+    }
+    floodTile(&tiles[0]);
+    for (t = 1; t != numTiles; ++ t)
+    {
+        if (started[t])
+        {
+            joinThread(threads[t]);
+        }
+        else
+        {
+            floodTile(&tiles[t]);
+        }
+    }
+
+    for (t = 0; t != numTiles; ++ t)
+    {
+        if (! tiles[t].sub)
+        {
+            fprintf(stderr, "Out of memory for watershed tile\n");
+            abort();
+        }
+        adoptTile(self, &tiles[t]);
+        wshed_free(tiles[t].sub);
+    }
+
+    /* Union non-edge neighbours across each seam */
+    for (t = 1; t != numTiles; ++ t)
+    {
+        y = tiles[t].y0;
+        deltas = neighborDeltas[self->options.connectivity][(y - 1) & 1];
+        for (x = 0; x != self->width; ++ x)
+        {
+            ci = (y - 1) * self->width + x;
+            if (! hasSegment(self, ci)) continue;
+            for (k = 0; k != self->numNeighbors; ++ k)
+            {
+                nx = x + deltas[k][0];
+                if (deltas[k][1] != 1 || nx < 0 || nx >= self->width) continue;
+                ni = y * self->width + nx;
+                if (! hasSegment(self, ni)) continue;
+                if (self->options.mergeTree)
+                {
+                    logJoin(self, pixelLevel(self, x, y - 1),
+                            segRecord(self, self->cellSeg[ci]),
+                            segRecord(self, self->cellSeg[ni]));
+                }
+                wshed_merge(segRecord(self, self->cellSeg[ci]),
+                            segRecord(self, self->cellSeg[ni]));
+            }
+        }
+    }
+
+    /* Tiles counted their overlap rows too; rebuild stats from core rows */
+    for (seg = 0; seg != self->numSegs; ++ seg)
+    {
+        struct wsGridCell *cp = segRecord(self, seg);
+        cp->mass = 0;
+        cp->minX = cp->minY = NO_MIN;
+        cp->maxX = cp->maxY = NO_MAX;
+        cp->xSum = cp->ySum = 0;
+        cp->atBorder = 0;
+    }
+    for (y = 0; y != self->height; ++ y)
+    {
+        ci = y * self->width;
+        for (x = 0; x != self->width; ++ x, ++ ci)
+        {
+            /* Edge pixels keep a record of their own, as a sequential
+             * flood leaves them */
+            if (self->cellSeg[ci] == WS_NO_SEG) continue;
+            addPixel(self, wshed_find(segRecord(self, self->cellSeg[ci])), x, y);
+        }
+    }
+
+    free(started);
+    free(threads);
+    free(tiles);
+    self->nextRank = self->numPixels;
+    return FPR_DONE;
+}
+
+enum fillPixResult wshed_fill(struct wshed *self,
+                              struct wsGridCell **pixSeg,
+                              struct wsGridCell *mergePair[2],
+                              enum mergeResult const *pmr)
+{
+    enum fillPixResult fpr = FPR_NEEDSMERGE;
+    if (self->options.threads > 1)
+    {
+        return (self->nextRank == 0) ? floodTiled(self) : FPR_DONE;
+    }
+    if (pmr) goto RESUME;
+    if (self->nextRank >= self->numPixels) return FPR_DONE;
+    for (;;)
+    {
+        fpr = fillPixel(self, pixSeg, mergePair);
+        switch (fpr)
+        {
+        case FPR_NEEDSMERGE:
+            if (self->mergeStrategy)
+            {
+                enum mergeResult mr =
+                    (*self->mergeStrategy)(self, mergePair[0], mergePair[1]);
+                pmr = &mr;
+RESUME:
+                if (self->options.mergeTree &&
+                    wshed_find(mergePair[0]) == wshed_find(mergePair[1]))
+                {
+                    /* Keep the event described when the conflict arose */
+                    ++ self->numMergeEvents;
+                }
+                switch (*pmr)
+                {
+                case MR_RETRY:
+                    continue;
+                case MR_EDGE:
+                    {
+                        int x, y;
+                        self->flags[rankToCell(self, self->nextRank, &x, &y)]
+                            = WS_VISITED | WS_EDGE;
+                    }
+                    goto ADVANCE;
+                case MR_SKIP:
+                    goto ADVANCE;
+                case MR_YIELD:
+                    break;
+				case MR_STOP:
+					return FPR_DONE;
+                default:
+                    fprintf(stderr, "Invalid merge result: %d\n", (int)*pmr);
+                    abort();
+                    break;
+                }
+            }
+            return FPR_NEEDSMERGE;
+
+        case FPR_NEW:
+        case FPR_EXTENDED:
+ADVANCE:
             ++ self->nextRank;
             if (self->nextRank >= self->numPixels)
             {
-                return FPR_DONE;   
+                return FPR_DONE;   
+            }
+            break;
+
+        case FPR_DONE:
+            return FPR_DONE;   
+
+        default:
+            fprintf(stderr, "Invalid pixel fill result: %d\n", (int)fpr);
+            abort();
+            break;
+        }
+    }
+}
+
+/* Clipped neighbours of (x, y), as cell indices; returns how many */
+static int neighborCells(const struct wshed *self, int x, int y,
+                         l_int32 cells[8])
+{
+    const l_int8 (*deltas)[2] =
+        neighborDeltas[self->options.connectivity][y & 1];
+    int k, nx, ny, n = 0;
+
+    for (k = 0; k != self->numNeighbors; ++ k)
+    {
+        nx = x + deltas[k][0];
+        ny = y + deltas[k][1];
+        if (0 <= nx && nx < self->width && 0 <= ny && ny < self->height)
+        {
+            cells[n++] = ny * self->width + nx;
+        }
+    }
+    return n;
+}
+
+/* Nonzero if a neighbour of (x, y) belongs to a segment lighter than thres */
+static int nearPebble(const struct wshed *self, int x, int y, l_int32 thres)
+{
+    l_int32 cells[8];
+    int k, n = neighborCells(self, x, y, cells);
+
+    for (k = 0; k != n; ++ k)
+    {
+        if (hasSegment(self, cells[k]) &&
+            wshed_find(segRecord(self, self->cellSeg[cells[k]]))->mass < thres)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Raises the intensity of every pending pixel next to a segment of less
+ * than thres pixels by val, so that pebbles grow before their neighbours
+ * claim the pixels around them.  Only the boosted pixels are sorted again;
+ * they are then merged back into the rest of the pending queue, which is
+ * still in order.  The pixel at nextRank, which may be waiting on a merge,
+ * keeps its place.  Returns the number boosted, or -1 for a flood with no
+ * sorted queue or if out of memory.
+ */
+l_int32 wshed_setSmallSegPriority(struct wshed *self, l_int32 thres,
+                                  l_float32 val)
+{
+    struct pixel *queue = self->queue, *boosted;
+    int i, w, out, k, first = self->nextRank + 1, numBoosted = 0;
+
+    if (self->options.threads > 1 || self->options.queueMode != WQ_SORTED)
+    {
+        return -1;
+    }
+    /* The sort is done with scratch, but a restored flood has none */
+    boosted = reserveBuffer(self, self->scratch, &self->scratchCap,
+                            (size_t)self->numPixels * sizeof (*boosted));
+    self->scratch = boosted;
+    if (! boosted) return -1;
+    w = self->numPixels;
+    for (i = self->numPixels - 1; i >= first; -- i)
+    {
+        if (nearPebble(self, queue[i].x, queue[i].y, thres))
+        {
+            boosted[numBoosted] = queue[i];
+            boosted[numBoosted].intensity += val;
+            ++ numBoosted;
+        }
+        else
+        {
+            queue[-- w] = queue[i];
+        }
+    }
+    if (numBoosted == 0) return 0;
+    qsort(boosted, numBoosted, sizeof (*boosted), qs_compare_pixels);
+    out = first;
+    for (k = 0; k != numBoosted; ++ out)
+    {
+        if (w != self->numPixels &&
+            qs_compare_pixels(&queue[w], &boosted[k]) < 0)
+        {
+            queue[out] = queue[w ++];
+        }
+        else
+        {
+            queue[out] = boosted[k ++];
+        }
+    }
+    return numBoosted;
+}
+
+/*
+ * Absorbs an edge pixel into the segments around it, if at most one of
+ * them has critMass pixels or more.  Any lighter segments are merged into
+ * that one (or into each other) along with the pixel.
+ */
+static int absorbEdge(struct wshed *self, l_uint32 ci, l_int32 critMass)
+{
+    l_int32 cells[8];
+    struct wsGridCell *roots[8], *root;
+    int k, j, n, numRoots = 0, numLive = 0;
+    int x = ci % self->width, y = ci / self->width;
+    l_float32 level = pixelLevel(self, x, y);
+
+    n = neighborCells(self, x, y, cells);
+    for (k = 0; k != n; ++ k)
+    {
+        if (! hasSegment(self, cells[k])) continue;
+        root = wshed_find(segRecord(self, self->cellSeg[cells[k]]));
+        for (j = 0; j != numRoots && roots[j] != root; ++ j)
+        {
+        }
+        if (j != numRoots) continue;
+        roots[numRoots++] = root;
+        if (root->mass >= critMass && ++ numLive > 1) return 0;
+    }
+    if (numRoots == 0) return 0;
+    for (k = 1; k != numRoots; ++ k)
+    {
+        if (self->options.mergeTree) logJoin(self, level, roots[0], roots[k]);
+        wshed_merge(roots[0], roots[k]);
+    }
+    root = wshed_find(roots[0]);
+    self->flags[ci] = WS_VISITED;
+    if (self->cellSeg[ci] == WS_NO_SEG)
+    {
+        self->cellSeg[ci] = root->index;
+        addPixel(self, root, x, y);
+    }
+    else
+    {
+        /* The pixel got a record of its own when the conflict arose */
+        if (self->options.mergeTree)
+        {
+            logJoin(self, level, root, segRecord(self, self->cellSeg[ci]));
+        }
+        wshed_merge(root, segRecord(self, self->cellSeg[ci]));
+    }
+    return 1;
+}
+
+/* Cell flooded at rank; a tiled flood keeps no order, so use scan order */
+static l_uint32 floodedCell(const struct wshed *self, int rank)
+{
+    int x, y;
+    if (self->options.threads > 1) return (l_uint32)rank;
+    return (l_uint32)rankToCell(self, rank, &x, &y);
+}
+
+/*
+ * Clears stray edge pixels and dead segments: absorbs edge pixels as
+ * absorbEdge allows, in flood order, and repeats until a pass absorbs
+ * none.  Returns the number of pixels absorbed, or -1 if out of memory.
+ */
+l_int32 wshed_prune(struct wshed *self, l_int32 critMass)
+{
+    l_uint32 *edges, ci;
+    int rank, i, numEdges = 0, kept, absorbed = 0;
+    int numRanks = (self->options.threads > 1) ? self->numPixels
+                                               : self->nextRank;
+
+    for (rank = 0; rank != numRanks; ++ rank)
+    {
+        if (self->flags[floodedCell(self, rank)] & WS_EDGE) ++ numEdges;
+    }
+    if (numEdges == 0) return 0;
+    edges = malloc(numEdges * sizeof (*edges));
+    if (! edges) return -1;
+    numEdges = 0;
+    for (rank = 0; rank != numRanks; ++ rank)
+    {
+        ci = floodedCell(self, rank);
+        if (self->flags[ci] & WS_EDGE) edges[numEdges++] = ci;
+    }
+    for (;;)
+    {
+        kept = 0;
+        for (i = 0; i != numEdges; ++ i)
+        {
+            if (! absorbEdge(self, edges[i], critMass))
+            {
+                edges[kept++] = edges[i];
             }
-            break;
+        }
+        absorbed += numEdges - kept;
+        if (kept == numEdges || kept == 0) break;
+        numEdges = kept;
+    }
+    free(edges);
+    return absorbed;
+}
 
-        case FPR_DONE:
-            return FPR_DONE;   
+/*
+ * Streaming flood, for images too big to hold at once.  The image is read
+ * a row at a time, in order, and flooded in bands of bandRows rows; like
+ * a tile, each band floods options.overlap rows beyond its own on either
+ * side.  Segments seen in a band's own rows get records of their own;
+ * only those still touching its last row (the seam) are kept for the next
+ * band to join, and the rest are passed to the sink and forgotten.
+ */
+#define DEFAULT_STREAM_BAND_ROWS 256
+/* A band's pixels have 16-bit coordinates; the open records do not */
+#define MAX_BAND_SIZE 0x7fff
 
-        default:
-            fprintf(stderr, "Invalid pixel fill result: %d\n", (int)fpr);
-            abort();
-            break;
+struct wshedStream
+{
+    l_int32 width, height;
+    struct wshedOptions options;
+    wshedRowReader reader;
+    void *readerCtx;
+    FPIX *fpix;             /* Rows sy0 to sy1 of the image */
+    l_int32 sy0, sy1;
+    struct wshed *band;     /* Flood of fpix, reset for each band */
+    struct wshed *open;     /* Records of the segments seen, and nothing else */
+    l_uint32 *seam, *nextSeam;  /* Record of each pixel on the last row */
+    l_uint32 *bandRec;      /* Record of each root in band */
+    l_uint32 *keep;         /* New index of each open record */
+    struct wsGridCell *kept;
+    size_t bandRecCap, keepCap;
+};
+
+static void freeStream(struct wshedStream *st)
+{
+    fpixDestroy(&st->fpix);
+    wshed_free(st->band);
+    wshed_free(st->open);
+    free(st->seam);
+    free(st->nextSeam);
+    free(st->bandRec);
+    free(st->keep);
+    free(st->kept);
+}
+
+/* Grows *pbuf to hold n l_uint32s, all set to WS_NO_SEG */
+static int clearIndices(l_uint32 **pbuf, size_t *cap, size_t n)
+{
+    if (n > *cap)
+    {
+        l_uint32 *grown = realloc(*pbuf, n * sizeof (**pbuf));
+        if (! grown) return 1;
+        *pbuf = grown;
+        *cap = n;
+    }
+    memset(*pbuf, 0xff, n * sizeof (**pbuf));
+    return 0;
+}
+
+/* Moves the window on to rows sy0 to sy1, keeping the rows it shares
+ * with the last one and reading the rest */
+static int readRows(struct wshedStream *st, l_int32 sy0, l_int32 sy1)
+{
+    FPIX *fpix = fpixCreate(st->width, sy1 - sy0);
+    l_int32 y = sy0;
+
+    if (! fpix) return 1;
+    if (st->fpix && st->sy1 > sy0)
+    {
+        y = st->sy1;
+        fpixRasterop(fpix, 0, 0, st->width, st->sy1 - sy0,
+                     st->fpix, 0, sy0 - st->sy0);
+    }
+    fpixDestroy(&st->fpix);
+    st->fpix = fpix;
+    st->sy0 = sy0;
+    st->sy1 = sy1;
+    for (; y != sy1; ++ y)
+    {
+        if ((*st->reader)(st->readerCtx, y,
+                          fpixGetData(fpix) + (y - sy0) * fpixGetWpl(fpix)))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Floods rows y0 to y1 (with their overlap) and gives each segment seen
+ * there a record in st->open, joined to those on the seam above */
+static int floodBand(struct wshedStream *st, l_int32 y0, l_int32 y1,
+                     const struct wshedMergeParams *params)
+{
+    struct wshed *band;
+    struct wsGridCell *pixSeg, *mergePair[2], *cp;
+    const l_int8 (*deltas)[2];
+    enum mergeResult mr = MR_EDGE;
+    l_int32 x, y, ci, k, nx;
+    l_uint32 root;
+    l_float32 level;
+
+    if (st->band)
+    {
+        if (wshed_reset(st->band, st->fpix)) return 1;
+    }
+    else
+    {
+        st->band = wshed_create(st->fpix, &st->options);
+        if (! st->band) return 1;
+        if (params) wshed_setMergeRule(st->band, params);
+        if (! st->band->mergeStrategy) st->band->mergeStrategy = ruleAlways;
+    }
+    band = st->band;
+    if (wshed_fill(band, &pixSeg, mergePair, NULL) != FPR_DONE)
+    {
+        while (wshed_fill(band, &pixSeg, mergePair, &mr) != FPR_DONE)
+        {
+        }
+    }
+
+    if (clearIndices(&st->bandRec, &st->bandRecCap, band->numSegs)) return 1;
+    for (y = y0; y != y1; ++ y)
+    {
+        ci = (y - st->sy0) * st->width;
+        for (x = 0; x != st->width; ++ x, ++ ci)
+        {
+            st->nextSeam[x] = WS_NO_SEG;
+            if (! hasSegment(band, ci)) continue;
+            root = wshed_find(segRecord(band, band->cellSeg[ci]))->index;
+            level = fpixGetData(st->fpix)[ci];
+            if (st->bandRec[root] == WS_NO_SEG)
+            {
+                st->bandRec[root] = newSegment(st->open, x, y, level);
+            }
+            else
+            {
+                cp = segRecord(st->open, st->bandRec[root]);
+                addPixel(st->open, cp, x, y);
+                if (level > cp->peak) cp->peak = level;
+            }
+            st->nextSeam[x] = st->bandRec[root];
+        }
+    }
+
+    /* Union non-edge neighbours across the seam, as floodTiled does */
+    if (y0 == 0) return 0;
+    deltas = neighborDeltas[st->options.connectivity][(y0 - 1) & 1];
+    for (x = 0; x != st->width; ++ x)
+    {
+        if (st->seam[x] == WS_NO_SEG) continue;
+        for (k = 0; k != neighborCounts[st->options.connectivity]; ++ k)
+        {
+            nx = x + deltas[k][0];
+            if (deltas[k][1] != 1 || nx < 0 || nx >= st->width) continue;
+            ci = (y0 - st->sy0) * st->width + nx;
+            if (! hasSegment(band, ci)) continue;
+            root = wshed_find(segRecord(band, band->cellSeg[ci]))->index;
+            wshed_merge(segRecord(st->open, st->seam[x]),
+                        segRecord(st->open, st->bandRec[root]));
+        }
+    }
+    return 0;
+}
+
+/* Passes every segment that misses the new seam to the sink, then keeps
+ * only the records of those that touch it.  Returns how many were passed. */
+static l_int32 closeSegments(struct wshedStream *st, int last,
+                             wshedSegmentSink sink, void *sinkCtx)
+{
+    struct wshed *open = st->open;
+    struct wsGridCell *cp;
+    l_uint32 seg, numKept = 0, *swap;
+    l_int32 x, numClosed = 0;
+
+    if (clearIndices(&st->keep, &st->keepCap, open->numSegs)) return -1;
+    for (x = 0; x != st->width && ! last; ++ x)
+    {
+        if (st->nextSeam[x] == WS_NO_SEG) continue;
+        seg = wshed_find(segRecord(open, st->nextSeam[x]))->index;
+        if (st->keep[seg] == WS_NO_SEG)
+        {
+            st->kept[numKept] = *segRecord(open, seg);
+            st->keep[seg] = numKept ++;
+        }
+        st->nextSeam[x] = st->keep[seg];
+    }
+    for (seg = 0; seg != open->numSegs; ++ seg)
+    {
+        cp = segRecord(open, seg);
+        if (cp->parent != cp || st->keep[seg] != WS_NO_SEG) continue;
+        if (sink) (*sink)(sinkCtx, cp);
+        ++ numClosed;
+    }
+
+    open->numSegs = 0;
+    for (seg = 0; seg != numKept; ++ seg)
+    {
+        cp = segRecord(open, newSegment(open, 0, 0, 0.0f));
+        *cp = st->kept[seg];
+        cp->parent = cp;
+        cp->index = seg;
+        cp->rank = 0;
+    }
+    swap = st->seam;
+    st->seam = st->nextSeam;
+    st->nextSeam = swap;
+    return numClosed;
+}
+
+l_int32 wshed_stream(l_int32 width, l_int32 height, l_int32 bandRows,
+                     const struct wshedOptions *options,
+                     const struct wshedMergeParams *params,
+                     wshedRowReader reader, void *readerCtx,
+                     wshedSegmentSink sink, void *sinkCtx)
+{
+    struct wshedStream st;
+    l_int32 y0, y1, sy0, sy1, closed, total = 0;
+
+    if (width <= 0 || width > MAX_BAND_SIZE || height <= 0 || ! reader)
+    {
+        return -1;
+    }
+    memset(&st, 0, sizeof st);
+    st.width = width;
+    st.height = height;
+    if (options) st.options = *options;
+    st.options.arena = NULL;
+    st.options.mergeTree = 0;
+    if (st.options.overlap <= 0) st.options.overlap = DEFAULT_TILE_OVERLAP;
+    if (st.options.overlap > MAX_BAND_SIZE / 4) return -1;
+    if (bandRows <= 0) bandRows = DEFAULT_STREAM_BAND_ROWS;
+    /* Room for the overlap either side, plus a row to start on an even one */
+    if (bandRows > MAX_BAND_SIZE - 2 * st.options.overlap - 1)
+    {
+        bandRows = MAX_BAND_SIZE - 2 * st.options.overlap - 1;
+    }
+    st.reader = reader;
+    st.readerCtx = readerCtx;
+    st.open = calloc(1, sizeof (*st.open));
+    st.seam = malloc(width * sizeof (*st.seam));
+    st.nextSeam = malloc(width * sizeof (*st.nextSeam));
+    st.kept = malloc(width * sizeof (*st.kept));
+    if (! (st.open && st.seam && st.nextSeam && st.kept) ||
+        st.options.connectivity < WC_8 || st.options.connectivity > WC_HEX)
+    {
+        freeStream(&st);
+        return -1;
+    }
+    st.open->width = width;
+    st.open->height = height;
+
+    for (y0 = 0; y0 != height; y0 = y1)
+    {
+        y1 = (height - y0 > bandRows) ? y0 + bandRows : height;
+        /* Start on an even row to keep the parity of hex rows */
+        sy0 = (y0 > st.options.overlap) ? y0 - st.options.overlap : 0;
+        sy0 &= ~1;
+        sy1 = (height - y1 > st.options.overlap) ? y1 + st.options.overlap
+                                                 : height;
+        if (readRows(&st, sy0, sy1) || floodBand(&st, y0, y1, params))
+        {
+            freeStream(&st);
+            return -1;
+        }
+        closed = closeSegments(&st, y1 == height, sink, sinkCtx);
+        if (closed < 0)
+        {
+            freeStream(&st);
+            return -1;
+        }
+        total += closed;
+    }
+    freeStream(&st);
+    return total;
+}
+
+l_int32 wshed_pixRowReader(void *ctx, l_int32 y, l_float32 *row)
+{
+    PIX *pix = (PIX *)ctx;
+    const l_uint32 *line;
+    l_int32 w, h, d, x;
+
+    if (pixGetDimensions(pix, &w, &h, &d) || y < 0 || y >= h) return 1;
+    line = pixGetData(pix) + y * pixGetWpl(pix);
+    switch (d)
+    {
+    case 8:
+        for (x = 0; x != w; ++ x) row[x] = (l_float32)GET_DATA_BYTE(line, x);
+        return 0;
+    case 16:
+        for (x = 0; x != w; ++ x)
+        {
+            row[x] = (l_float32)GET_DATA_TWO_BYTES(line, x);
+        }
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+/*
+ * Snapshots.  The buffer is a header followed by the segment records, the
+ * flood order and the two grid arrays, each at a 16-byte aligned offset,
+ * so that a restored wshed can use them where they lie.  Records store
+ * their parent's index in place of the pointer.  The layout is that of
+ * the host (sizes are checked on restore, byte order is not).
+ */
+#define WS_SNAPSHOT_MAGIC 0x31535357U   /* "WSS1" */
+#define WS_SNAPSHOT_VERSION 4
+
+struct snapshotHeader
+{
+    l_uint32 magic, version;
+    l_uint32 headerSize, recordSize, pixelSize, pointerSize;
+    l_int32 width, height;
+    l_int32 queueMode, levels, threads, overlap, mergeTree, connectivity;
+    l_int32 nextRank;
+    l_float32 level;
+    l_uint32 numSegs, numMergeEvents;
+    l_int32 clientDataIntA, clientDataIntB;
+    l_int64 clientDataInt64;
+    struct wshedMergeParams mergeParams;
+    l_uint64 segOffset, eventsOffset;
+    l_uint64 queueOffset, orderOffset, cellSegOffset, flagsOffset;
+    l_uint64 size;
+};
+
+/* Fills in the offsets and size from the dimensions and numSegs.  An
+ * offset of 0 means the array is absent. */
+static void snapshotLayout(struct snapshotHeader *hdr,
+                           int hasQueue, int hasOrder)
+{
+    size_t numPixels = (size_t)hdr->width * hdr->height;
+    size_t numCells = (size_t)hdr->width * hdr->height;
+    size_t off = ARENA_ALIGN(sizeof (*hdr));
+
+    hdr->segOffset = off;
+    off += ARENA_ALIGN(hdr->numSegs * sizeof (struct wsGridCell));
+    hdr->eventsOffset = off;
+    off += ARENA_ALIGN(hdr->numMergeEvents * sizeof (struct wshedMergeEvent));
+    hdr->queueOffset = hasQueue ? off : 0;
+    if (hasQueue) off += ARENA_ALIGN(numPixels * sizeof (struct pixel));
+    hdr->orderOffset = hasOrder ? off : 0;
+    if (hasOrder) off += ARENA_ALIGN(numPixels * sizeof (l_uint32));
+    hdr->cellSegOffset = off;
+    off += ARENA_ALIGN(numCells * sizeof (l_uint32));
+    hdr->flagsOffset = off;
+    off += ARENA_ALIGN(numCells * sizeof (l_uint8));
+    hdr->size = off;
+}
+
+size_t wshed_snapshot(const struct wshed *self, void *buf, size_t size)
+{
+    struct snapshotHeader hdr;
+    struct wsGridCell rec;
+    char *base = (char *)buf;
+    size_t numCells = (size_t)self->width * self->height;
+    l_uint32 seg;
+
+    memset(&hdr, 0, sizeof hdr);
+    hdr.magic = WS_SNAPSHOT_MAGIC;
+    hdr.version = WS_SNAPSHOT_VERSION;
+    hdr.headerSize = sizeof hdr;
+    hdr.recordSize = sizeof rec;
+    hdr.pixelSize = sizeof (struct pixel);
+    hdr.pointerSize = sizeof (void *);
+    hdr.width = self->width;
+    hdr.height = self->height;
+    hdr.queueMode = self->options.queueMode;
+    hdr.levels = self->options.levels;
+    hdr.threads = self->options.threads;
+    hdr.overlap = self->options.overlap;
+    hdr.mergeTree = self->options.mergeTree;
+    hdr.connectivity = self->options.connectivity;
+    hdr.nextRank = self->nextRank;
+    hdr.level = self->level;
+    hdr.numSegs = self->numSegs;
+    hdr.numMergeEvents = self->numMergeEvents;
+    hdr.clientDataIntA = self->clientDataIntA;
+    hdr.clientDataIntB = self->clientDataIntB;
+    hdr.clientDataInt64 = self->clientDataInt64;
+    hdr.mergeParams = self->mergeParams;
+    snapshotLayout(&hdr, self->queue != NULL, self->order != NULL);
+    if (! buf || size < hdr.size) return (size_t)hdr.size;
+
+    memcpy(base, &hdr, sizeof hdr);
+    for (seg = 0; seg != self->numSegs; ++ seg)
+    {
+        rec = *segRecord(self, seg);
+        rec.parent = (struct wsGridCell *)(size_t)rec.parent->index;
+        memcpy(base + hdr.segOffset + seg * sizeof rec, &rec, sizeof rec);
+    }
+    if (self->numMergeEvents)
+    {
+        memcpy(base + hdr.eventsOffset, self->mergeEvents,
+               self->numMergeEvents * sizeof (*self->mergeEvents));
+    }
+    if (self->queue)
+    {
+        memcpy(base + hdr.queueOffset, self->queue,
+               self->numPixels * sizeof (*self->queue));
+    }
+    if (self->order)
+    {
+        memcpy(base + hdr.orderOffset, self->order,
+               self->numPixels * sizeof (*self->order));
+    }
+    memcpy(base + hdr.cellSegOffset, self->cellSeg,
+           numCells * sizeof (*self->cellSeg));
+    memcpy(base + hdr.flagsOffset, self->flags,
+           numCells * sizeof (*self->flags));
+    return (size_t)hdr.size;
+}
+
+/* Whether the options and progress in a snapshot's header are ones a
+ * wshed could have had, with the queue or order array its mode uses */
+static int snapshotHeaderValid(const struct snapshotHeader *hdr)
+{
+    l_int64 numPixels = (l_int64)hdr->width * hdr->height;
+    int tiled = hdr->threads > 1;
+
+    return (hdr->queueMode == WQ_SORTED || hdr->queueMode == WQ_BUCKETS) &&
+           hdr->connectivity >= WC_8 && hdr->connectivity <= WC_HEX &&
+           hdr->levels > 0 && hdr->overlap > 0 &&
+           hdr->nextRank >= 0 && hdr->nextRank <= numPixels &&
+           (hdr->queueOffset != 0) ==
+               (! tiled && hdr->queueMode == WQ_SORTED) &&
+           (hdr->orderOffset != 0) ==
+               (! tiled && hdr->queueMode == WQ_BUCKETS);
+}
+
+/* Parent index of record seg of a snapshot (as stored in place of the
+ * pointer) */
+#define SNAPSHOT_PARENT(records, seg) \
+    ((l_uint32)(size_t)(records)[seg].parent)
+
+/*
+ * Whether every index in the body of a snapshot (whose layout has been
+ * checked) is in range: records' own indices and parents, merge events,
+ * the cells' records, and the queue's or order's cells.  Parent chains
+ * must also end at a root, so that wshed_find cannot loop.  Linear in the
+ * size of the snapshot.  0 if out of memory.
+ */
+static int snapshotBodyValid(const struct snapshotHeader *hdr,
+                             const char *base)
+{
+    const struct wsGridCell *records =
+        (const struct wsGridCell *)(base + hdr->segOffset);
+    const struct wshedMergeEvent *events =
+        (const struct wshedMergeEvent *)(base + hdr->eventsOffset);
+    const l_uint32 *cellSeg = (const l_uint32 *)(base + hdr->cellSegOffset);
+    size_t numCells = (size_t)hdr->width * hdr->height, i;
+    l_uint32 seg, p, numSegs = hdr->numSegs;
+    l_uint8 *state;
+
+    for (i = 0; i != numCells; ++ i)
+    {
+        if (cellSeg[i] != WS_NO_SEG && cellSeg[i] >= numSegs) return 0;
+    }
+    if (hdr->queueOffset)
+    {
+        const struct pixel *queue =
+            (const struct pixel *)(base + hdr->queueOffset);
+        for (i = 0; i != numCells; ++ i)
+        {
+            if (queue[i].x < 0 || queue[i].x >= hdr->width ||
+                queue[i].y < 0 || queue[i].y >= hdr->height)
+            {
+                return 0;
+            }
+        }
+    }
+    if (hdr->orderOffset)
+    {
+        const l_uint32 *order = (const l_uint32 *)(base + hdr->orderOffset);
+        for (i = 0; i != numCells; ++ i)
+        {
+            if (order[i] >= numCells) return 0;
+        }
+    }
+    for (i = 0; i != hdr->numMergeEvents; ++ i)
+    {
+        if (events[i].seg[0] >= numSegs || events[i].seg[1] >= numSegs)
+        {
+            return 0;
+        }
+    }
+    for (seg = 0; seg != numSegs; ++ seg)
+    {
+        if (records[seg].index != seg ||
+            SNAPSHOT_PARENT(records, seg) >= numSegs)
+        {
+            return 0;
+        }
+    }
+
+    /* 0: not seen; 1: on the chain being followed; 2: reaches a root */
+    state = calloc(numSegs ? numSegs : 1, 1);
+    if (! state) return 0;
+    for (seg = 0; seg != numSegs; ++ seg)
+    {
+        for (p = seg; state[p] == 0; p = SNAPSHOT_PARENT(records, p))
+        {
+            state[p] = 1;
+            if (SNAPSHOT_PARENT(records, p) == p)
+            {
+                state[p] = 2;
+                break;
+            }
+        }
+        if (state[p] != 2)
+        {
+            free(state);
+            return 0;
+        }
+        for (p = seg; state[p] == 1; p = SNAPSHOT_PARENT(records, p))
+        {
+            state[p] = 2;
+        }
+    }
+    free(state);
+    return 1;
+}
+
+struct wshed *wshed_restoreInPlace(void *buf, size_t size, FPIX *fpix)
+{
+    struct snapshotHeader hdr, expect;
+    struct wshed *self;
+    struct wsGridCell *records, *cp;
+    char *base = (char *)buf;
+    size_t numCells;
+    l_int32 width, height;
+    l_uint32 seg, block;
+
+    if (! (buf && fpix) || size < sizeof hdr || ((size_t)buf & 7)) return NULL;
+    memcpy(&hdr, buf, sizeof hdr);
+    if (hdr.magic != WS_SNAPSHOT_MAGIC ||
+        hdr.version != WS_SNAPSHOT_VERSION ||
+        hdr.headerSize != sizeof hdr ||
+        hdr.recordSize != sizeof (struct wsGridCell) ||
+        hdr.pixelSize != sizeof (struct pixel) ||
+        hdr.pointerSize != sizeof (void *) ||
+        hdr.numSegs > size / sizeof (struct wsGridCell) ||
+        hdr.numMergeEvents > size / sizeof (struct wshedMergeEvent) ||
+        ! snapshotHeaderValid(&hdr))
+    {
+        return NULL;
+    }
+    fpixGetDimensions(fpix, &width, &height);
+    expect = hdr;
+    snapshotLayout(&expect, hdr.queueOffset != 0, hdr.orderOffset != 0);
+    if (width != hdr.width || height != hdr.height ||
+        memcmp(&expect, &hdr, sizeof hdr) || hdr.size > size ||
+        ! snapshotBodyValid(&hdr, base))
+    {
+        return NULL;
+    }
+
+    self = calloc(1, sizeof (*self));
+    if (! self) return NULL;
+    self->options.queueMode = (enum wshedQueueMode)hdr.queueMode;
+    self->options.levels = hdr.levels;
+    self->options.threads = hdr.threads;
+    self->options.overlap = hdr.overlap;
+    self->options.mergeTree = hdr.mergeTree;
+    self->options.connectivity = (enum wshedConnectivity)hdr.connectivity;
+    /* The buffer is not ours to free, just as an arena isn't */
+    self->arenaBase = buf;
+    self->arenaSize = size;
+    self->fpix = fpixClone(fpix);
+    self->width = width;
+    self->height = height;
+    self->numPixels = width * height;
+    if (setupNeighbors(self))
+    {
+        wshed_free(self);
+        return NULL;
+    }
+    self->nextRank = hdr.nextRank;
+    self->level = hdr.level;
+    self->clientDataIntA = hdr.clientDataIntA;
+    self->clientDataIntB = hdr.clientDataIntB;
+    self->clientDataInt64 = hdr.clientDataInt64;
+    numCells = (size_t)width * height;
+    if (hdr.queueOffset)
+    {
+        self->queue = (struct pixel *)(base + hdr.queueOffset);
+        self->queueCap = self->numPixels * sizeof (*self->queue);
+    }
+    if (hdr.orderOffset)
+    {
+        self->order = (l_uint32 *)(base + hdr.orderOffset);
+        self->orderCap = self->numPixels * sizeof (*self->order);
+    }
+    self->cellSeg = (l_uint32 *)(base + hdr.cellSegOffset);
+    self->cellSegCap = numCells * sizeof (*self->cellSeg);
+    self->flags = (l_uint8 *)(base + hdr.flagsOffset);
+    self->flagsCap = numCells * sizeof (*self->flags);
+    /* The event log is copied out once it grows */
+    self->mergeEvents = (struct wshedMergeEvent *)(base + hdr.eventsOffset);
+    self->numMergeEvents = self->mergeEventsCap = hdr.numMergeEvents;
+
+    /* Full blocks of records stay in the buffer.  The last one is copied
+     * out, as newSegment will fill it up. */
+    records = (struct wsGridCell *)(base + hdr.segOffset);
+    self->numSegs = hdr.numSegs;
+    if (reserveSegBlocks(self,
+                         (hdr.numSegs + SEG_BLOCK_MASK) >> SEG_BLOCK_BITS))
+    {
+        wshed_free(self);
+        return NULL;
+    }
+    self->numSegBlocks = (hdr.numSegs + SEG_BLOCK_MASK) >> SEG_BLOCK_BITS;
+    for (block = 0; block != self->numSegBlocks; ++ block)
+    {
+        cp = records + ((size_t)block << SEG_BLOCK_BITS);
+        if (((block + 1) << SEG_BLOCK_BITS) <= hdr.numSegs)
+        {
+            self->segBlocks[block] = cp;
+            continue;
+        }
+        self->segBlocks[block] =
+            malloc(SEG_BLOCK_SIZE * sizeof (**self->segBlocks));
+        if (! self->segBlocks[block])
+        {
+            self->numSegBlocks = block;
+            wshed_free(self);
+            return NULL;
         }
+        memcpy(self->segBlocks[block], cp,
+               (hdr.numSegs - (block << SEG_BLOCK_BITS)) * sizeof (*cp));
+    }
+    for (seg = 0; seg != hdr.numSegs; ++ seg)
+    {
+        cp = segRecord(self, seg);
+        cp->parent = segRecord(self, SNAPSHOT_PARENT(cp, 0));
     }
+    wshed_setMergeRule(self, &hdr.mergeParams);
+    return self;
 }
 
+struct wshed *wshed_restore(const void *buf, size_t size, FPIX *fpix)
+{
+    struct wshed *self;
+    void *copy = malloc(size ? size : 1);
+
+    if (! copy) return NULL;
+    memcpy(copy, buf, size);
+    self = wshed_restoreInPlace(copy, size, fpix);
+    if (! self)
+    {
+        free(copy);
+        return NULL;
+    }
+    self->snapshot = copy;
+    return self;
+}
@@ -30,14 +30,91 @@ struct pixel
     l_int16 x, y;
 };
 
+enum wshedQueueMode
+{
+    WQ_SORTED,      // Flood in exact intensity order (full sort)
+    WQ_BUCKETS      // Flood by quantized intensity; scan order within a level
+};
+
+enum wshedConnectivity
+{
+    WC_8,           // Pixels touching at edges or corners are neighbours
+    WC_4,           // Only pixels sharing an edge are neighbours
+    WC_HEX          // Hexagonal grid; odd rows are offset half a pixel right
+};
+
+// Caller-owned memory that a wshed carves its per-frame buffers from
+// instead of the heap.  The wshed never frees it; once every wshed using it
+// has been freed, the caller may set used back to 0.
+struct wshedArena
+{
+    void *base;
+    size_t size, used;
+};
+
+struct wshedOptions
+{
+    enum wshedQueueMode queueMode;
+    l_int32 levels;     // Number of buckets for WQ_BUCKETS (0 = 65536)
+    l_int32 threads;    // > 1 floods that many bands in parallel
+    l_int32 overlap;    // Rows each band floods beyond its seams (0 = 16)
+    struct wshedArena *arena;   // Optional; see wshed_arenaSize
+    l_int32 mergeTree;  // Nonzero logs merges, for wshed_cutLabels
+    enum wshedConnectivity connectivity;
+};
+
+enum wsCellFlags
+{
+    WS_VISITED = 1,
+    WS_EDGE = 2
+};
+
+// Segment record.  Only pixels that start a segment (or are handed to a
+// merge strategy) get one; other pixels refer to their segment's record.
+// The statistics are kept up to date on union-find roots only.
 struct wsGridCell
 {
-    l_int8 visited, edge, rank, unused1;
+    l_int8 visited, edge, rank;
+    l_int8 atBorder;        // Segment touches the edge of the image
     l_int32 mass;
-    l_int16 minX, maxX, minY, maxY;
+    l_int32 minX, maxX, minY, maxY;     // Wide enough for wshed_stream
+    float peak;             // Highest intensity in the segment
+    l_uint32 index;         // Position in the watershed's record table
+    double xSum, ySum;      // Coordinate sums, for the centroid
     struct wsGridCell *parent;
 };
 
+enum wshedMergeRule
+{
+    WM_CALLER,      // Use mergeStrategy as set, or defer every conflict
+    WM_ALWAYS,      // Merge every conflict
+    WM_EDGE,        // Never merge; conflicting pixels become edges
+    WM_MASS,        // Merge if either segment has mass < minMass
+    WM_BBOX,        // Merge if either bbox is under maxWidth x maxHeight
+    WM_DEPTH        // Merge if either segment's peak is < minDepth above
+                    // the current pixel
+};
+
+struct wshedMergeParams
+{
+    enum wshedMergeRule rule;
+    enum mergeResult otherwise;     // Result when the rule doesn't merge
+    l_int32 minMass;
+    l_int32 maxWidth, maxHeight;
+    float minDepth;
+};
+
+// A merge of two roots, with each side as it was just before
+struct wshedMergeEvent
+{
+    float level;            // Intensity of the pixel where they met
+    l_uint32 seg[2];        // Record indices of the two roots
+    l_int32 mass[2];
+    float peak[2];
+    l_int16 spanX[2], spanY[2];     // maxX - minX and maxY - minY
+    l_int32 join;           // Nonzero if every cut keeps it
+};
+
 struct wshed
 {
     void *clientDataPtr;
@@ -45,15 +122,41 @@ struct wshed
     l_int64 clientDataInt64;
     FPIX *fpix;
     l_int32 width, height, numPixels;
+    struct wshedOptions options;
     int nextRank;
-    struct pixel *queue;
-    struct wsGridCell *pgrid;
+    l_int32 numNeighbors;   // 4, 6 or 8, from options.connectivity
+    l_int32 neighborOffsets[2][8];  // Cell index deltas, by row parity
+    struct pixel *queue;    // Flood order for WQ_SORTED, otherwise NULL
+    l_uint32 *order;        // Flood order (as y*width+x) for WQ_BUCKETS
+    l_uint8 *flags;         // wsCellFlags of each pixel (y*width+x)
+    l_uint32 *cellSeg;      // Segment record index of each grid cell
+    void *scratch;          // Sort or bucket-count workspace
+    size_t queueCap, orderCap, flagsCap, cellSegCap, scratchCap; // In bytes
+    void *arenaBase;        // Bounds of options.arena (or of the snapshot
+    size_t arenaSize;       // restored in place), for wshed_free
+    void *snapshot;         // Copy made by wshed_restore
+    struct wsGridCell **segBlocks;
+    l_uint32 numSegs, segBlocksCap;
+    l_uint32 numSegBlocks;  // Record blocks allocated (kept by wshed_reset)
+    struct wshedMergeEvent *mergeEvents;    // In order, if options.mergeTree
+    l_uint32 numMergeEvents, mergeEventsCap;
+    float level;            // Intensity of the pixel needing a merge
+    struct wshedMergeParams mergeParams;
     enum mergeResult (*mergeStrategy)(struct wshed *self,
                                       struct wsGridCell *seg1,
                                       struct wsGridCell *seg2);
 };
 
-struct wshed *wshed_create(FPIX *fpix);
+struct wshed *wshed_create(FPIX *fpix, const struct wshedOptions *options);
+
+// Starts over on a new image, keeping the options, merge rule and client
+// data.  Buffers are only reallocated if they are too small, so a stream of
+// same-sized frames allocates nothing after the first.  Returns 0 on success.
+int wshed_reset(struct wshed *wshed, FPIX *fpix);
+
+// Bytes of options->arena needed for width x height frames
+size_t wshed_arenaSize(l_int32 width, l_int32 height,
+                       const struct wshedOptions *options);
 
 struct wsGridCell *wshed_find(struct wsGridCell *p);
 
@@ -61,11 +164,99 @@ void wshed_free(struct wshed *wshed);
 
 void wshed_merge(struct wsGridCell *p, struct wsGridCell *q);
 
+// Root segment of the pixel at (x, y), or NULL for unvisited/edge pixels
+struct wsGridCell *wshed_segmentAt(struct wshed *wshed, int x, int y);
+
+int wshed_flagsAt(struct wshed *wshed, int x, int y);
+
+// Bulk extraction into Leptonica images; each returns 0 on success.
+// 1-bpp mask of seg's segment (only the bits within its bbox are written).
+// Fails for a seg that is not a record of this watershed.
+int wshed_maskSegment(struct wshed *wshed, struct wsGridCell *seg,
+                      PIX *out);
+// 1-bpp mask of every pixel the flood has not reached
+int wshed_maskUnvisited(struct wshed *wshed, PIX *out);
+// 32-bpp image of root record index + 1 per pixel (0 = no segment)
+int wshed_labelRoots(struct wshed *wshed, PIX *out);
+
+enum { WS_NO_LABEL = -1 };
+// 32-bpp image of dense segment IDs 0..N-1, numbered in scan order of each
+// segment's first pixel, and WS_NO_LABEL for edge/unvisited pixels.
+// Returns N, or -1 on error.
+l_int32 wshed_labels(struct wshed *wshed, PIX *out);
+
+// As wshed_labels, for a flood with options.mergeTree, but keeping only the
+// logged merges that the built-in rule in params allows (the flood's own
+// rule and params->otherwise are irrelevant).  Pixels that the flood made
+// edges stay WS_NO_LABEL.  Returns -1 without a merge tree or for WM_CALLER.
+l_int32 wshed_cutLabels(struct wshed *wshed,
+                        const struct wshedMergeParams *params, PIX *out);
+
+// Installs a built-in mergeStrategy (or clears it, for WM_CALLER)
+void wshed_setMergeRule(struct wshed *wshed,
+                        const struct wshedMergeParams *params);
+
 enum fillPixResult wshed_fill(struct wshed *wshed,
                               struct wsGridCell **pixSeg,
                               struct wsGridCell *mergePair[2],
                               enum mergeResult const *pmr);
 
+// Adds val to the intensity of each pending pixel next to a segment of
+// fewer than thres pixels, and re-sorts the pending queue.  The pixel at
+// nextRank (which may await a merge) stays put.  Returns the number of
+// pixels boosted, or -1 unless the flood is WQ_SORTED and single-threaded
+// (or if out of memory).
+l_int32 wshed_setSmallSegPriority(struct wshed *wshed, l_int32 thres,
+                                  l_float32 val);
+
+// Repeatedly joins edge pixels to the segments around them, when at most
+// one of those has critMass pixels or more (the rest are merged into it).
+// Returns the number of edge pixels absorbed, or -1 if out of memory.
+l_int32 wshed_prune(struct wshed *wshed, l_int32 critMass);
+
+// Reads row y of an image into row (width floats); nonzero on failure
+typedef l_int32 (*wshedRowReader)(void *ctx, l_int32 y, l_float32 *row);
+// Receives a finished segment; the record is only valid during the call
+typedef void (*wshedSegmentSink)(void *ctx, const struct wsGridCell *seg);
+
+// Floods a width x height image that is read a row at a time, in order, in
+// bands of bandRows rows (0 = 256), each flooded with options.overlap rows
+// either side as options.threads > 1 floods its tiles.  Each segment is
+// passed to sink (if any) as soon as no later row can join it.  Memory is
+// that of a wshed on one band, not the whole image.  params is a built-in
+// merge rule (NULL merges every conflict); options.arena and mergeTree
+// are ignored.  height is unlimited, but width may be at most 32767 and
+// bandRows is capped to keep each band (with its overlap) within that.
+// Returns the number of segments, or -1 on failure.
+l_int32 wshed_stream(l_int32 width, l_int32 height, l_int32 bandRows,
+                     const struct wshedOptions *options,
+                     const struct wshedMergeParams *params,
+                     wshedRowReader reader, void *readerCtx,
+                     wshedSegmentSink sink, void *sinkCtx);
+
+// wshedRowReader for an 8- or 16-bpp PIX (ctx) as wide as the stream
+l_int32 wshed_pixRowReader(void *ctx, l_int32 y, l_float32 *row);
+
+// Serializes the flood state into buf and returns its size.  If buf is
+// NULL or smaller than that, nothing is written.  Snapshots may be taken
+// whenever wshed_fill has returned; a restored flood resumes with
+// wshed_fill(..., NULL), which raises any pending merge again.  Built-in
+// merge rules are kept, but not clientDataPtr or a caller's mergeStrategy.
+size_t wshed_snapshot(const struct wshed *wshed, void *buf, size_t size);
+
+// A wshed resumed from a snapshot, which must have been taken of a flood
+// over fpix (or an image of the same size and contents).  Returns NULL if
+// the snapshot is invalid: every index in it is checked to be in range and
+// every parent chain to end, in time linear in its size, so a truncated or
+// corrupt snapshot is refused rather than read out of bounds.
+struct wshed *wshed_restore(const void *buf, size_t size, FPIX *fpix);
+
+// As wshed_restore, but the wshed works on buf directly instead of a copy
+// (e.g. on a MAP_PRIVATE mapping of a snapshot file).  buf must be 8-byte
+// aligned and writable, must outlive the wshed, and can be restored from
+// only once.
+struct wshed *wshed_restoreInPlace(void *buf, size_t size, FPIX *fpix);
+
 // vim: filetype=c:
 /*]])
 package.loaded[m] = ffilib(m)
@@ -1,6 +1,7 @@
 local lj_src_dir = "..\\luajit-2.0\\src"
 local luajit = string.format("%s\\luajit.exe", lj_src_dir)
 local precompile_modules = {
+  {name="Segment"},
   {name="Watershed"},
   {name="ffilib"},
   {name="ffiu"},
@@ -10,8 +11,10 @@ local precompile_modules = {
   {name="lept.PixA", input="lept\\PixA.lua", output="PixA.c"},
   {name="lept.Pta", input="lept\\Pta.lua", output="Pta.c"},
   {name="liblept"},
+  {name="nbc_cdef"},
   {name="pixelsort_cdef"},
   {name="point16"},
+  {name="xmath_cdef"},
 }
 
 local luaPath = string.format("%s\\?.lua", lj_src_dir)
@@ -0,0 +1,295 @@
+#include <math.h>
+#include <stddef.h>
+
+#ifdef _MSC_VER
+typedef __int32 int32_t;
+typedef __int64 int64_t;
+typedef unsigned __int32 uint32_t;
+typedef unsigned __int64 uint64_t;
+#else
+#include <stdint.h>
+#endif
+
+/* SSE2 exp kernels; -DGROD_NO_SIMD keeps them scalar */
+#ifndef GROD_NO_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define GROD_SSE2
+#include <emmintrin.h>
+#endif
+#endif
+
+#include "xmath_cdef.lua"
+
+/*
+ * exp of x <= 0.  x = k ln 2 + r with |r| <= ln 2 / 2 (ln 2 split in two,
+ * after Cody and Waite, so that k ln 2 is exact), exp r from its Taylor
+ * polynomial to r^12 (r^7 for floats) in Estrin's scheme, which leaves
+ * more multiplies independent than Horner's, and 2^k written straight
+ * into the exponent bits.  Truncation error is below 2e-16 (6e-9 for
+ * floats); measured against libm, the total is under 5e-16 (2e-7).  x
+ * below EXP_MIN, where 2^k would not be normal, gives exactly 0 (as does
+ * -inf).
+ */
+#define EXP_MIN (-708.0)
+#define EXPF_MIN (-87.0f)
+
+static const double LOG2E = 1.4426950408889634;
+static const double LN2_HI = 6.93145751953125e-1;
+static const double LN2_LO = 1.42860682030941723212e-6;
+static const float LN2_HI_F = 6.93359375e-1f;
+static const float LN2_LO_F = -2.12194440e-4f;
+
+/* 1/0!, 1/1!, ..., 1/12! */
+#define E0 1.0
+#define E1 1.0
+#define E2 5.0e-1
+#define E3 1.66666666666666666667e-1
+#define E4 4.16666666666666666667e-2
+#define E5 8.33333333333333333333e-3
+#define E6 1.38888888888888888889e-3
+#define E7 1.98412698412698412698e-4
+#define E8 2.48015873015873015873e-5
+#define E9 2.75573192239858906526e-6
+#define E10 2.75573192239858906526e-7
+#define E11 2.50521083854417187751e-8
+#define E12 2.08767569878680989792e-9
+
+/* The Taylor polynomials, given MUL, ADD and constant-making K for the
+ * type, and powers r, r2 = r^2, r4 = r^4 (and r8 = r^8 for doubles) */
+#define EXP_POLY(MUL, ADD, K, r, r2, r4, r8) \
+    ADD(ADD(ADD(ADD(K(E0), MUL(K(E1), r)), \
+                MUL(r2, ADD(K(E2), MUL(K(E3), r)))), \
+            MUL(r4, ADD(ADD(K(E4), MUL(K(E5), r)), \
+                        MUL(r2, ADD(K(E6), MUL(K(E7), r)))))), \
+        MUL(r8, ADD(ADD(ADD(K(E8), MUL(K(E9), r)), \
+                        MUL(r2, ADD(K(E10), MUL(K(E11), r)))), \
+                    MUL(r4, K(E12)))))
+#define EXPF_POLY(MUL, ADD, K, r, r2, r4) \
+    ADD(ADD(ADD(K(E0), MUL(K(E1), r)), \
+            MUL(r2, ADD(K(E2), MUL(K(E3), r)))), \
+        MUL(r4, ADD(ADD(K(E4), MUL(K(E5), r)), \
+                    MUL(r2, ADD(K(E6), MUL(K(E7), r))))))
+
+#define S_MUL(a, b) ((a) * (b))
+#define S_ADD(a, b) ((a) + (b))
+#define S_K(c) (c)
+#define SF_K(c) ((float)(c))
+
+static double expNeg(double x)
+{
+    union { double d; uint64_t u; } scale;
+    double k, r, r2, r4, p;
+
+    if (x != x) return x;
+    if (x < EXP_MIN) return 0;
+    k = floor(x * LOG2E + .5);
+    r = (x - k * LN2_HI) - k * LN2_LO;
+    r2 = r * r;
+    r4 = r2 * r2;
+    p = EXP_POLY(S_MUL, S_ADD, S_K, r, r2, r4, r4 * r4);
+    scale.u = (uint64_t)((int64_t)k + 1023) << 52;
+    return p * scale.d;
+}
+
+static float expNegF(float x)
+{
+    union { float f; uint32_t u; } scale;
+    float k, r, r2, p;
+
+    if (x != x) return x;
+    if (x < EXPF_MIN) return 0;
+    k = (float)floor(x * (float)LOG2E + .5f);
+    r = (x - k * LN2_HI_F) - k * LN2_LO_F;
+    r2 = r * r;
+    p = EXPF_POLY(S_MUL, S_ADD, SF_K, r, r2, r2 * r2);
+    scale.u = (uint32_t)((int32_t)k + 127) << 23;
+    return p * scale.f;
+}
+
+#ifdef GROD_SSE2
+/* expNeg of both lanes (k rounded to even rather than up at halves) */
+static __m128d expNeg2(__m128d x)
+{
+    __m128d nan = _mm_cmpunord_pd(x, x);
+    __m128d tiny = _mm_cmplt_pd(x, _mm_set1_pd(EXP_MIN));
+    __m128d y = _mm_max_pd(x, _mm_set1_pd(EXP_MIN));
+    __m128i ki = _mm_cvtpd_epi32(_mm_mul_pd(y, _mm_set1_pd(LOG2E)));
+    __m128d k = _mm_cvtepi32_pd(ki);
+    __m128d r, r2, r4, p;
+
+    r = _mm_sub_pd(_mm_sub_pd(y, _mm_mul_pd(k, _mm_set1_pd(LN2_HI))),
+                   _mm_mul_pd(k, _mm_set1_pd(LN2_LO)));
+    r2 = _mm_mul_pd(r, r);
+    r4 = _mm_mul_pd(r2, r2);
+    p = EXP_POLY(_mm_mul_pd, _mm_add_pd, _mm_set1_pd, r, r2, r4,
+                 _mm_mul_pd(r4, r4));
+    ki = _mm_add_epi32(ki, _mm_set1_epi32(1023));
+    ki = _mm_slli_epi64(_mm_unpacklo_epi32(ki, _mm_setzero_si128()), 52);
+    p = _mm_andnot_pd(tiny, _mm_mul_pd(p, _mm_castsi128_pd(ki)));
+    return _mm_or_pd(_mm_andnot_pd(nan, p), _mm_and_pd(nan, x));
+}
+
+#define SF_SET(c) _mm_set1_ps((float)(c))
+
+/* expNegF of all four lanes */
+static __m128 expNeg4(__m128 x)
+{
+    __m128 nan = _mm_cmpunord_ps(x, x);
+    __m128 tiny = _mm_cmplt_ps(x, _mm_set1_ps(EXPF_MIN));
+    __m128 y = _mm_max_ps(x, _mm_set1_ps(EXPF_MIN));
+    __m128i ki = _mm_cvtps_epi32(_mm_mul_ps(y, _mm_set1_ps((float)LOG2E)));
+    __m128 k = _mm_cvtepi32_ps(ki);
+    __m128 r, r2, p;
+
+    r = _mm_sub_ps(_mm_sub_ps(y, _mm_mul_ps(k, _mm_set1_ps(LN2_HI_F))),
+                   _mm_mul_ps(k, _mm_set1_ps(LN2_LO_F)));
+    r2 = _mm_mul_ps(r, r);
+    p = EXPF_POLY(_mm_mul_ps, _mm_add_ps, SF_SET, r, r2,
+                  _mm_mul_ps(r2, r2));
+    ki = _mm_slli_epi32(_mm_add_epi32(ki, _mm_set1_epi32(127)), 23);
+    p = _mm_andnot_ps(tiny, _mm_mul_ps(p, _mm_castsi128_ps(ki)));
+    return _mm_or_ps(_mm_andnot_ps(nan, p), _mm_and_ps(nan, x));
+}
+#endif
+
+/* Sum of exp(x[i] - shift), each also stored in dst[i] if dst is not NULL */
+static double sumExp(const double *x, int32_t n, double shift, double *dst)
+{
+    double sum = 0;
+    int32_t i = 0;
+#ifdef GROD_SSE2
+    __m128d vShift = _mm_set1_pd(shift), acc = _mm_setzero_pd(), e;
+    double lanes[2];
+
+    for (; i + 2 <= n; i += 2)
+    {
+        e = expNeg2(_mm_sub_pd(_mm_loadu_pd(x + i), vShift));
+        if (dst) _mm_storeu_pd(dst + i, e);
+        acc = _mm_add_pd(acc, e);
+    }
+    _mm_storeu_pd(lanes, acc);
+    sum = lanes[0] + lanes[1];
+#endif
+    for (; i < n; ++ i)
+    {
+        double e = expNeg(x[i] - shift);
+        if (dst) dst[i] = e;
+        sum += e;
+    }
+    return sum;
+}
+
+static double sumExpF(const float *x, int32_t n, float shift, float *dst)
+{
+    double sum = 0;
+    int32_t i = 0;
+#ifdef GROD_SSE2
+    __m128 vShift = _mm_set1_ps(shift), e;
+    __m128d acc = _mm_setzero_pd();
+    double lanes[2];
+
+    for (; i + 4 <= n; i += 4)
+    {
+        e = expNeg4(_mm_sub_ps(_mm_loadu_ps(x + i), vShift));
+        if (dst) _mm_storeu_ps(dst + i, e);
+        acc = _mm_add_pd(acc, _mm_add_pd(_mm_cvtps_pd(e),
+                                         _mm_cvtps_pd(_mm_movehl_ps(e, e))));
+    }
+    _mm_storeu_pd(lanes, acc);
+    sum = lanes[0] + lanes[1];
+#endif
+    for (; i < n; ++ i)
+    {
+        float e = expNegF(x[i] - shift);
+        if (dst) dst[i] = e;
+        sum += e;
+    }
+    return sum;
+}
+
+static double maxOf(const double *x, int32_t n)
+{
+    double top = -HUGE_VAL;
+    int32_t i;
+
+    for (i = 0; i < n; ++ i)
+    {
+        if (x[i] > top) top = x[i];
+    }
+    return top;
+}
+
+static float maxOfF(const float *x, int32_t n)
+{
+    float top = (float)-HUGE_VAL;
+    int32_t i;
+
+    for (i = 0; i < n; ++ i)
+    {
+        if (x[i] > top) top = x[i];
+    }
+    return top;
+}
+
+double xmath_logSumExp(const double *x, int32_t n)
+{
+    double top = maxOf(x, n);
+
+    if (top == -HUGE_VAL) return top;
+    return top + log(sumExp(x, n, top, NULL));
+}
+
+double xmath_logSumExpF(const float *x, int32_t n)
+{
+    float top = maxOfF(x, n);
+
+    if (top == (float)-HUGE_VAL) return top;
+    return top + log(sumExpF(x, n, top, NULL));
+}
+
+double xmath_softmax(const double *x, int32_t n, double *dst)
+{
+    double top = maxOf(x, n), sum, scale;
+    int32_t i;
+
+    if (top == -HUGE_VAL)
+    {
+        for (i = 0; i < n; ++ i)
+        {
+            dst[i] = 0;
+        }
+        return top;
+    }
+    sum = sumExp(x, n, top, dst);
+    scale = 1 / sum;
+    for (i = 0; i < n; ++ i)
+    {
+        dst[i] *= scale;
+    }
+    return top + log(sum);
+}
+
+double xmath_softmaxF(const float *x, int32_t n, float *dst)
+{
+    float top = maxOfF(x, n);
+    double sum;
+    float scale;
+    int32_t i;
+
+    if (top == (float)-HUGE_VAL)
+    {
+        for (i = 0; i < n; ++ i)
+        {
+            dst[i] = 0;
+        }
+        return top;
+    }
+    sum = sumExpF(x, n, top, dst);
+    scale = (float)(1 / sum);
+    for (i = 0; i < n; ++ i)
+    {
+        dst[i] *= scale;
+    }
+    return top + log(sum);
+}
@@ -1,4 +1,5 @@
 local ffi = require 'ffi'
+local cxmath = require 'xmath_cdef'
 
 local xmath = {__index=math}
 setmetatable(xmath, xmath)
@@ -34,24 +35,69 @@ local function logit(x)
 end
 xmath.logit = logit
 
-local function softmax(es, n, dst)
-  n = n or #es
-  dst = dst or {}
+-- The largest of es[1..n], and the (Kahan) sum of exp(es[i] - largest),
+-- each stored in dst[i] too if dst is given
+local function sumExp(es, n, dst)
+  local top = -math.huge
+  for i = 1, n do
+    if es[i] > top then top = es[i] end
+  end
   local s, c = 0, 0
   for i = 1, n do
-    local y = exp(es[i])
-    dst[i] = y
+    local y = exp(es[i] - top)
+    if dst then dst[i] = y end
     y = y - c
     local t = s + y
     c = (t - s) - y
     s = t
   end
+  return top, s
+end
+
+-- log(sum of exp(es[i])), without overflow or underflow, over es[1..n]
+-- (n defaults to #es) of a list or es[0..n-1] of a double array (and of
+-- a float array with logsumexpf)
+local function logsumexp(es, n)
+  if type(es) == 'cdata' then
+    return cxmath.xmath_logSumExp(es, n)
+  end
+  local top, s = sumExp(es, n or #es)
+  if top == -math.huge then return top end
+  return top + log(s)
+end
+xmath.logsumexp = logsumexp
+
+function xmath.logsumexpf(es, n)
+  return cxmath.xmath_logSumExpF(es, n)
+end
+
+-- exp(es[i] - logsumexp(es)) for each i, as for logsumexp, into dst.  For
+-- a list, dst defaults to a new list; for an array, to es itself, so that
+-- an array is normalised in place.  Returns dst and logsumexp(es).
+local function softmax(es, n, dst)
+  if type(es) == 'cdata' then
+    dst = dst or es
+    return dst, cxmath.xmath_softmax(es, n, dst)
+  end
+  n = n or #es
+  dst = dst or {}
+  local top, s = sumExp(es, n, dst)
+  if top == -math.huge then
+    for i = 1, n do
+      dst[i] = 0
+    end
+    return dst, top
+  end
   for i = 1, n do
     dst[i] = dst[i] / s
   end
-  return dst
+  return dst, top + log(s)
 end
-
 xmath.softmax = softmax
 
+function xmath.softmaxf(es, n, dst)
+  dst = dst or es
+  return dst, cxmath.xmath_softmaxF(es, n, dst)
+end
+
 return xmath
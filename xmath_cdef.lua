@@ -0,0 +1,26 @@
+#include "cdef.h"
+tonumber(((function(m)--[[] ])))/*]]
+
+local ffi = require 'ffi'
+local ffilib = require 'ffilib'
+
+ffi.cdef("/"..[[**/
+
+// log(sum of exp(x[i])) over x[0..n-1], shifted by the largest x[i] so
+// that it neither overflows nor underflows.  -inf if n is 0 or every x[i]
+// is -inf.
+double xmath_logSumExp(const double *x, int32_t n);
+double xmath_logSumExpF(const float *x, int32_t n);
+
+// dst[i] = exp(x[i] - logSumExp(x)) for i in 0..n-1 (dst may be x), and
+// returns logSumExp(x).  The exps are SIMD approximations with relative
+// error below 1e-15 (double) or 1e-6 (float); those too small to be
+// normal (and exp(-inf)) come out as 0.  If every x[i] is -inf, dst is
+// all 0 and the result is -inf.
+double xmath_softmax(const double *x, int32_t n, double *dst);
+double xmath_softmaxF(const float *x, int32_t n, float *dst);
+
+// vim: filetype=c:
+/*]])
+package.loaded[m] = ffilib(m)
+end)(...)))--*/